@@ -0,0 +1,104 @@
+#ifndef ALLOCATION_TABLE_H
+#define ALLOCATION_TABLE_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// File allocation table of a linked disk, kept apart from the data: one
+// entry per block in flat arrays, the way a FAT lists the next cluster.
+//
+// next(b) is the block after b in its file (or on the free list), -1 at the
+// end, and prev(b) the block before it. With the skip index on, every block
+// of a file also has a jump pointer back towards the first block, over
+// 2^j - 1 blocks for some j (Myers' skew-binary jump pointers). A jump only
+// depends on the block's position in the file, so appending a block sets
+// its jump in O(1) from the block before it, and the block at any position
+// is reached from the last block in O(log n) jumps and prev steps instead of
+// n next steps. Entries are left uninitialised, so the pages of the arrays
+// are only faulted in once blocks get used.
+class AllocationTable
+{
+public:
+    AllocationTable(int num_blocks, bool skip_index)
+        : next_block(new int[num_blocks]), prev_block(new int[num_blocks]),
+          jump_block(skip_index ? new int[num_blocks] : nullptr), jump_depth{0} {}
+
+    bool hasSkipIndex() const { return jump_block != nullptr; }
+
+    int &next(int block) { return next_block[block]; }
+    int next(int block) const { return next_block[block]; }
+    int &prev(int block) { return prev_block[block]; }
+
+    // make block the block at position depth of a file, right after after
+    // (-1 for the first block), and the end of the chain
+    void append(int after, int block, long long depth)
+    {
+        next_block[block] = -1;
+        prev_block[block] = after;
+        if (after != -1)
+            next_block[after] = block;
+        if (!jump_block)
+            return;
+        if (depth == 0)
+            jump_block[block] = block;
+        else
+            jump_block[block] = jumpFrom(depth) == depth - 1 ? after : jump_block[jump_block[after]];
+    }
+
+    // block at position target of the chain from first to last, which has
+    // length blocks; walked from first without the skip index
+    int seek(int first, int last, long long length, long long target)
+    {
+        if (target < 0 || target >= length)
+            return -1;
+        if (!jump_block)
+        {
+            int block = first;
+            for (long long i = 0; i < target; i++)
+                block = next_block[block];
+            return block;
+        }
+        int block = last;
+        for (long long depth = length - 1; depth > target;)
+        {
+            long long jump = jumpFrom(depth);
+            if (jump >= target)
+            {
+                block = jump_block[block];
+                depth = jump;
+            }
+            else
+            {
+                block = prev_block[block];
+                depth--;
+            }
+        }
+        return block;
+    }
+
+    // bytes of table entries for the first blocks blocks
+    size_t memoryBytes(long long blocks) const
+    {
+        return (size_t)blocks * (hasSkipIndex() ? 3 : 2) * sizeof(int) + jump_depth.capacity() * sizeof(int);
+    }
+
+private:
+    std::unique_ptr<int[]> next_block;
+    std::unique_ptr<int[]> prev_block;
+    std::unique_ptr<int[]> jump_block; // null without the skip index
+    std::vector<int> jump_depth;       // position a jump from position d lands on, grown as files get longer
+
+    long long jumpFrom(long long depth)
+    {
+        while ((long long)jump_depth.size() <= depth)
+        {
+            int p = (int)jump_depth.size() - 1;
+            int jp = jump_depth[p];
+            jump_depth.push_back(p - jp == jp - jump_depth[jp] ? jump_depth[jp] : p);
+        }
+        return jump_depth[depth];
+    }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef ATOMIC_BITMAP_H
+#define ATOMIC_BITMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Block map that many threads can allocate from at once.
+//
+// Same layout as Bitmap (one bit per block, set = allocated, bits past the
+// end kept set) but every word is atomic. A block is claimed by setting the
+// lowest clear bit of a word with compare-and-swap, so no lock is taken and
+// two threads can never get the same block; a thread that loses the race
+// retries on the word it read back. Callers pass a hint so threads start
+// their searches in different words and rarely touch the same cache line.
+class AtomicBitmap
+{
+public:
+    AtomicBitmap(int num_bits = 0) : num_words(0), num_bits(0)
+    {
+        resize(num_bits);
+    }
+
+    // drop all allocations and resize, not safe while other threads use the map
+    void resize(int new_num_bits)
+    {
+        num_bits = new_num_bits;
+        num_words = ((size_t)num_bits + 63) / 64;
+        words.reset(new std::atomic<uint64_t>[num_words]);
+        for (size_t w = 0; w < num_words; w++)
+            words[w].store(0, std::memory_order_relaxed);
+        if (num_bits & 63)
+            words[num_words - 1].store(~0ULL << (num_bits & 63), std::memory_order_relaxed);
+    }
+
+    int size() const { return num_bits; }
+
+    bool test(int i) const { return words[i >> 6].load(std::memory_order_acquire) >> (i & 63) & 1; }
+
+    // claims a free block, searching from the word holding hint and wrapping around, -1 if full
+    int allocate(int hint = 0)
+    {
+        if (num_words == 0)
+            return -1;
+        size_t first = hint > 0 && hint < num_bits ? (size_t)hint >> 6 : 0;
+        for (size_t n = 0, w = first; n < num_words; n++, w = w + 1 == num_words ? 0 : w + 1)
+        {
+            uint64_t word = words[w].load(std::memory_order_relaxed);
+            while (word != ~0ULL)
+            {
+                uint64_t bit = ~word & (word + 1); // lowest clear bit
+                if (words[w].compare_exchange_weak(word, word | bit, std::memory_order_acquire, std::memory_order_relaxed))
+                    return (int)(w * 64 + __builtin_ctzll(bit));
+            }
+        }
+        return -1;
+    }
+
+    void release(int i)
+    {
+        words[i >> 6].fetch_and(~(1ULL << (i & 63)), std::memory_order_release);
+    }
+
+    // free blocks at some moment during the call
+    int countFree() const
+    {
+        long long used = 0;
+        for (size_t w = 0; w < num_words; w++)
+            used += __builtin_popcountll(words[w].load(std::memory_order_relaxed));
+        return (int)((long long)num_words * 64 - used);
+    }
+
+    size_t memoryBytes() const { return num_words * sizeof(uint64_t); }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    size_t num_words;
+    int num_bits;
+};
+
+#endif
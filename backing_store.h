@@ -0,0 +1,183 @@
+#ifndef BACKING_STORE_H
+#define BACKING_STORE_H
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Swap space of one program for the page simulator: the program file, kept
+// open while the program runs, read a page at a time.
+//
+// MMAP maps the file once and hands out pointers into the mapping. PREAD
+// keeps the descriptor and reads a page with one pread, optionally through
+// a small LRU cache of pages of its own. REOPEN opens, seeks and closes the
+// file with an ifstream for every page, the way faults used to be served,
+// to compare against.
+class BackingStore
+{
+public:
+    enum class Mode
+    {
+        MMAP,
+        PREAD,
+        REOPEN
+    };
+
+    BackingStore() : fd(-1), base(nullptr), file_bytes(0), page_size(0), mode(Mode::MMAP), cache_pages(0) {}
+    ~BackingStore() { close(); }
+
+    BackingStore(const BackingStore &) = delete;
+    BackingStore &operator=(const BackingStore &) = delete;
+
+    // cache_pages only applies to PREAD, 0 for no cache
+    bool open(const std::string &program, int page_bytes, Mode how = Mode::MMAP, size_t cache_capacity = 0)
+    {
+        close();
+        path = program;
+        page_size = page_bytes;
+        mode = how;
+        cache_pages = how == Mode::PREAD ? cache_capacity : 0;
+        scratch.assign(page_size, 0);
+        if (mode == Mode::REOPEN)
+            return true;
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            std::cerr << "Error: could not open program " << path << ": " << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        file_bytes = st.st_size;
+        if (mode == Mode::MMAP && file_bytes > 0)
+        {
+            void *mapping = mmap(nullptr, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                std::cerr << "Error: could not map program " << path << ": " << strerror(errno) << std::endl;
+                close();
+                return false;
+            }
+            base = (const char *)mapping;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (base)
+            munmap((void *)base, file_bytes);
+        if (fd >= 0)
+            ::close(fd);
+        base = nullptr;
+        fd = -1;
+        file_bytes = 0;
+        cached.clear();
+        where.clear();
+    }
+
+    // The page_size bytes of page, valid until the next call; the
+    // part past the end of the file is zero. Points into the mapping with
+    // MMAP, into the cache or a scratch page otherwise.
+    const char *pageData(int page)
+    {
+        long long offset = (long long)page * page_size;
+        if (base && offset + page_size <= file_bytes)
+            return base + offset;
+        if (cache_pages > 0)
+            return cachedPage(page);
+        read(page, scratch.data());
+        return scratch.data();
+    }
+
+    // page page as a string, what a frame of the simulated RAM holds
+    std::string readPage(int page)
+    {
+        const char *data = pageData(page);
+        return std::string(data, strnlen(data, page_size));
+    }
+
+    long long hits() const { return hit_count; }
+    long long misses() const { return miss_count; }
+
+private:
+    struct CachedPage
+    {
+        int page;
+        std::vector<char> data;
+    };
+
+    std::string path;
+    int fd;
+    const char *base; // the mapping with MMAP
+    long long file_bytes;
+    int page_size;
+    Mode mode;
+    size_t cache_pages;
+    std::vector<char> scratch;
+    std::list<CachedPage> cached; // most recently used first
+    std::unordered_map<int, std::list<CachedPage>::iterator> where;
+    long long hit_count = 0;
+    long long miss_count = 0;
+
+    const char *cachedPage(int page)
+    {
+        auto found = where.find(page);
+        if (found != where.end())
+        {
+            hit_count++;
+            cached.splice(cached.begin(), cached, found->second);
+            return found->second->data.data();
+        }
+        miss_count++;
+        if (cached.size() < cache_pages)
+            cached.push_front({page, std::vector<char>(page_size)});
+        else
+        {
+            cached.splice(cached.begin(), cached, std::prev(cached.end())); // reuse the least recently used
+            where.erase(cached.front().page);
+            cached.front().page = page;
+        }
+        where[page] = cached.begin();
+        read(page, cached.front().data.data());
+        return cached.front().data.data();
+    }
+
+    // reads page into buffer, zero past the end of the file
+    void read(int page, char *buffer)
+    {
+        long long offset = (long long)page * page_size;
+        size_t done = 0;
+        if (mode == Mode::REOPEN)
+        {
+            std::ifstream swap_memory(path);
+            swap_memory.seekg(offset, std::ios::beg);
+            swap_memory.read(buffer, page_size);
+            done = swap_memory.gcount();
+        }
+        else
+        {
+            while (done < (size_t)page_size)
+            {
+                ssize_t got = pread(fd, buffer + done, page_size - done, offset + done);
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got <= 0)
+                    break;
+                done += got;
+            }
+        }
+        memset(buffer + done, 0, page_size - done);
+    }
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// one file of a createBatch call
+struct CreateRequest
+{
+    std::string name;
+    long long size; // bytes
+};
+
+// indices of requests sorted by size, equal sizes keep their request order
+inline std::vector<int> sizeOrder(const std::vector<CreateRequest> &requests, bool largest_first)
+{
+    std::vector<int> order(requests.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                     { return largest_first ? requests[a].size > requests[b].size : requests[a].size < requests[b].size; });
+    return order;
+}
+
+// sizeOrder of the requests that count: a name given more than once in a
+// batch only counts the first time, in request order, whatever its size
+inline std::vector<int> uniqueSizeOrder(const std::vector<CreateRequest> &requests, bool largest_first)
+{
+    std::unordered_set<std::string_view> names;
+    names.reserve(requests.size());
+    std::vector<int> order;
+    std::vector<bool> first(requests.size());
+    for (size_t i = 0; i < requests.size(); i++)
+        first[i] = names.insert(requests[i].name).second;
+    for (int i : sizeOrder(requests, largest_first))
+        if (first[i])
+            order.push_back(i);
+    return order;
+}
+
+#endif
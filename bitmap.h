@@ -0,0 +1,408 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Packed free-block bitmap, one bit per block, 64 blocks per word.
+// A set bit means the block is allocated. Searches skip whole words with
+// ctz and count with popcount; when compiled with -mavx2 the word scans and
+// the free count look at four words per instruction.
+//
+// Free searches also skip full regions through a summary: level 0 has a bit
+// per word that is set when the word is full, every level above a bit per
+// word of the level below, up to a single word. Finding the next word with
+// a free block climbs until a level has a clear bit and walks back down, so
+// it costs a few words per level however much of the disk is full. Setting
+// and clearing bits keep the summary up to date.
+//
+// Bits past the end of the map and of every summary level are kept set so a
+// scan never has to check the last word specially.
+class Bitmap
+{
+public:
+    // scans use AVX2 when it is compiled in, clear this to force the scalar path
+    static inline bool use_simd = true;
+    // free searches skip full words through the summary, clear this to scan every word
+    static inline bool use_summary = true;
+
+    Bitmap(int num_bits = 0) : num_bits(0)
+    {
+        resize(num_bits);
+    }
+
+    // grow or shrink the map, new blocks start free
+    void resize(int new_num_bits)
+    {
+        int old_num_bits = num_bits;
+        num_bits = new_num_bits;
+        summary.clear(); // rebuilt for the new size below
+        words.resize(((size_t)num_bits + 63) / 64, 0);
+        if (new_num_bits > old_num_bits)
+            clearRange(old_num_bits, new_num_bits - old_num_bits);
+        padTail();
+        buildSummary();
+    }
+
+    int size() const { return num_bits; }
+
+    bool test(int i) const { return words[i >> 6] >> (i & 63) & 1; }
+    bool operator[](int i) const { return test(i); }
+    void set(int i)
+    {
+        uint64_t &word = words[i >> 6];
+        word |= 1ULL << (i & 63);
+        if (word == ~0ULL)
+            markFull(i >> 6);
+    }
+    void clear(int i)
+    {
+        words[i >> 6] &= ~(1ULL << (i & 63));
+        markNotFull(i >> 6);
+    }
+
+    void setRange(int start, int count) { fillRange(start, count, true); }
+    void clearRange(int start, int count) { fillRange(start, count, false); }
+
+    // first free block at or after from, -1 if none
+    int findFirstFree(int from = 0) const { return findNext(from, false); }
+
+    // first allocated block at or after from, size() if none
+    int findFirstUsed(int from = 0) const
+    {
+        int i = findNext(from, true);
+        return i == -1 || i > num_bits ? num_bits : i;
+    }
+
+    // start of the first run of at least length free blocks at or after
+    // from, -1 if none. With a limit the run also has to end by it, so the
+    // search stops there.
+    int findFreeRun(int length, int from = 0, int limit = -1) const
+    {
+        if (limit < 0 || limit > num_bits)
+            limit = num_bits;
+        if (length <= 1)
+        {
+            int i = findFirstFree(from);
+            return i < limit ? i : -1;
+        }
+        if (from < 0)
+            from = 0;
+        if (from >= limit)
+            return -1;
+        auto fits = [&](int start)
+        { return start + length <= limit ? start : -1; };
+        size_t end_word = ((size_t)limit + 63) / 64;
+
+        int run = 0, run_start = 0; // free blocks carried over from the previous words
+        size_t w = from >> 6;
+        uint64_t free_bits = ~words[w] & (~0ULL << (from & 63));
+        while (true)
+        {
+            if (free_bits == 0)
+            {
+                // a full word ends the run, jump over any full words after it
+                run = 0;
+                if (++w < end_word && words[w] == ~0ULL)
+                    w = nextWordNotEqual(w, ~0ULL);
+                if (w >= end_word)
+                    return -1;
+                free_bits = ~words[w];
+                continue;
+            }
+            if (free_bits == ~0ULL)
+            {
+                if (run == 0)
+                    run_start = (int)(w * 64);
+                run += 64;
+                if (run >= length)
+                    return fits(run_start);
+            }
+            else
+            {
+                if (run > 0 && run + __builtin_ctzll(~free_bits) >= length)
+                    return fits(run_start);
+                if (length < 64)
+                {
+                    // bit p of inside survives only if blocks p .. p + length - 1 are all free
+                    uint64_t inside = free_bits;
+                    for (int k = 1; k < length && inside;)
+                    {
+                        int shift = std::min(k, length - k);
+                        inside &= inside >> shift;
+                        k += shift;
+                    }
+                    if (inside)
+                        return fits((int)(w * 64 + __builtin_ctzll(inside)));
+                }
+                run = __builtin_clzll(~free_bits);
+                run_start = (int)(w * 64 + 64 - run);
+            }
+            if (++w >= end_word)
+                return -1;
+            free_bits = ~words[w];
+        }
+    }
+
+    // Claims count free blocks in one forward pass from from, wrapping around
+    // to the start, and calls take(start, length) for every run claimed.
+    // Whole free runs are taken in address order, so the blocks of one call
+    // sit in runs next to each other, and full regions are skipped through
+    // the summary. Returns the blocks claimed, fewer than count only when
+    // the map ran out.
+    template <typename Fn>
+    long long allocateRuns(long long count, int from, Fn take)
+    {
+        if (from < 0 || from >= num_bits)
+            from = 0;
+        long long claimed = 0;
+        for (int pass = 0; pass < 2 && claimed < count; pass++)
+        {
+            int end = pass == 0 ? num_bits : from;
+            for (int i = pass == 0 ? from : 0; claimed < count && (i = findFirstFree(i)) != -1 && i < end;)
+            {
+                int length = freeRunEnd(i, (int)std::min<long long>(end, i + (count - claimed))) - i;
+                setRange(i, length);
+                take(i, length);
+                claimed += length;
+                i += length;
+            }
+        }
+        return claimed;
+    }
+
+    // number of free blocks
+    int countFree() const
+    {
+        int used = 0;
+        size_t w = 0;
+#ifdef __AVX2__
+        if (use_simd)
+        {
+            w = words.size() & ~(size_t)3;
+            used = (int)popcountAvx2(words.data(), w);
+        }
+#endif
+        for (; w < words.size(); w++)
+            used += __builtin_popcountll(words[w]);
+        return (int)(words.size() * 64) - used;
+    }
+
+    // bytes held by the map and its summary
+    size_t memoryBytes() const
+    {
+        size_t count = words.size();
+        for (const auto &level : summary)
+            count += level.size();
+        return count * sizeof(uint64_t);
+    }
+
+private:
+    std::vector<uint64_t> words;
+    std::vector<std::vector<uint64_t>> summary; // summary[0] has a bit per word, the last level one word
+    int num_bits;
+
+    void padTail()
+    {
+        if (num_bits & 63)
+            words.back() |= ~0ULL << (num_bits & 63);
+    }
+
+    void fillRange(int start, int count, bool value)
+    {
+        if (count <= 0)
+            return;
+        int end = start + count; // exclusive
+        int first = start >> 6, last = (end - 1) >> 6;
+        uint64_t head = ~0ULL << (start & 63);
+        uint64_t tail = ~0ULL >> (63 - ((end - 1) & 63));
+        if (first == last)
+        {
+            applyMask(words[first], head & tail, value);
+            refreshSummary(first, last);
+            return;
+        }
+        applyMask(words[first], head, value);
+        for (int w = first + 1; w < last; w++)
+            words[w] = value ? ~0ULL : 0;
+        applyMask(words[last], tail, value);
+        refreshSummary(first, last);
+    }
+
+    static void applyMask(uint64_t &word, uint64_t mask, bool value)
+    {
+        if (value)
+            word |= mask;
+        else
+            word &= ~mask;
+    }
+
+    // first bit equal to value at or after from, -1 if none
+    int findNext(int from, bool value) const
+    {
+        if (from < 0)
+            from = 0;
+        if (from >= num_bits)
+            return -1;
+        // words we are looking through have every bit equal to skip
+        uint64_t skip = value ? 0 : ~0ULL;
+        size_t w = from >> 6;
+        uint64_t bits = (words[w] ^ skip) & (~0ULL << (from & 63));
+        if (bits)
+            return (int)(w * 64 + __builtin_ctzll(bits));
+
+        w = nextWordNotEqual(w + 1, skip);
+        if (w == words.size())
+            return -1;
+        return (int)(w * 64 + __builtin_ctzll(words[w] ^ skip));
+    }
+
+    // end of the free run at from, looking no further than limit
+    int freeRunEnd(int from, int limit) const
+    {
+        size_t w = from >> 6;
+        uint64_t used = words[w] & (~0ULL << (from & 63));
+        while (!used)
+        {
+            if ((int)(++w * 64) >= limit)
+                return limit;
+            used = words[w];
+        }
+        return std::min(limit, (int)(w * 64 + __builtin_ctzll(used)));
+    }
+
+    // summary levels sized for the words, padding bits set, then filled in
+    void buildSummary()
+    {
+        summary.clear();
+        for (size_t count = words.size(); count > 1;)
+        {
+            size_t level_words = (count + 63) / 64;
+            summary.emplace_back(level_words, 0);
+            if (count & 63)
+                summary.back().back() = ~0ULL << (count & 63);
+            count = level_words;
+        }
+        if (!words.empty())
+            refreshSummary(0, words.size() - 1);
+    }
+
+    // recompute the summary bits above words first .. last
+    void refreshSummary(size_t first, size_t last)
+    {
+        for (size_t level = 0; level < summary.size(); level++)
+        {
+            const uint64_t *below = level == 0 ? words.data() : summary[level - 1].data();
+            for (size_t j = first; j <= last; j++)
+                applyMask(summary[level][j >> 6], 1ULL << (j & 63), below[j] == ~0ULL);
+            first >>= 6;
+            last >>= 6;
+        }
+    }
+
+    // word w just became full, set its bit and the bits of summary words that filled up with it
+    void markFull(size_t w)
+    {
+        for (auto &level : summary)
+        {
+            uint64_t &bits = level[w >> 6];
+            bits |= 1ULL << (w & 63);
+            if (bits != ~0ULL)
+                return;
+            w >>= 6;
+        }
+    }
+
+    // word w has a free block, clear its bit and those above it that were set
+    void markNotFull(size_t w)
+    {
+        for (auto &level : summary)
+        {
+            uint64_t &bits = level[w >> 6];
+            bool was_full = bits == ~0ULL;
+            bits &= ~(1ULL << (w & 63));
+            if (!was_full)
+                return;
+            w >>= 6;
+        }
+    }
+
+    // index of the first word at or after w with a free block, words.size() if none
+    size_t nextWordNotFull(size_t w) const
+    {
+        size_t n = words.size();
+        if (w >= n || words[w] != ~0ULL)
+            return w < n ? w : n;
+        // climb until a level has a clear bit at or after position pos
+        size_t level = 0, pos = w;
+        while (true)
+        {
+            if (level == summary.size() || (pos >> 6) >= summary[level].size())
+                return n;
+            uint64_t clear = ~summary[level][pos >> 6] & (~0ULL << (pos & 63));
+            if (clear)
+            {
+                pos = (pos & ~(size_t)63) + __builtin_ctzll(clear);
+                break;
+            }
+            pos = (pos >> 6) + 1;
+            level++;
+        }
+        // and walk down along the first clear bits to the word
+        while (level > 0)
+        {
+            level--;
+            pos = pos * 64 + __builtin_ctzll(~summary[level][pos]);
+        }
+        return pos;
+    }
+
+    // index of the first word at or after w that differs from skip
+    size_t nextWordNotEqual(size_t w, uint64_t skip) const
+    {
+        size_t n = words.size();
+        if (skip == ~0ULL && use_summary && !summary.empty())
+            return nextWordNotFull(w);
+#ifdef __AVX2__
+        if (use_simd)
+        {
+            __m256i pattern = _mm256_set1_epi64x((long long)skip);
+            for (; w + 4 <= n; w += 4)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(words.data() + w));
+                if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, pattern)) != -1)
+                    break;
+            }
+        }
+#endif
+        while (w < n && words[w] == skip)
+            w++;
+        return w;
+    }
+
+#ifdef __AVX2__
+    // popcount of n words (n a multiple of 4) using the nibble lookup method
+    static long long popcountAvx2(const uint64_t *p, size_t n)
+    {
+        const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+        __m256i total = _mm256_setzero_si256();
+        for (size_t i = 0; i < n; i += 4)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+            __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+        }
+        return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+               _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,142 @@
+// Microbenchmark for the free-block searches in bitmap.h against the
+// one-block-at-a-time scans the allocators used before.
+//
+// build: g++ -O2 -mavx2 bitmap_benchmark.cpp -o bitmap_benchmark
+// (without -mavx2 the "packed simd" rows fall back to the scalar path)
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <string>
+#include "bitmap.h"
+using namespace std;
+using namespace std::chrono;
+
+const int REPEATS = 20;    // timed repetitions of every search
+const int RUN_LENGTH = 64; // blocks wanted by the run search
+
+// old style scans over one bool per block
+int firstFreeBytes(const vector<bool> &blocks)
+{
+    for (int i = 0; i < (int)blocks.size(); i++)
+        if (!blocks[i])
+            return i;
+    return -1;
+}
+
+int freeRunBytes(const vector<bool> &blocks, int length)
+{
+    int n = blocks.size();
+    for (int i = 0; i < n; i++)
+    {
+        if (!blocks[i])
+        {
+            int j = i + 1;
+            while (j < n && !blocks[j])
+                j++;
+            if (j - i >= length)
+                return i;
+            i = j;
+        }
+    }
+    return -1;
+}
+
+int countFreeBytes(const vector<bool> &blocks)
+{
+    int free_blocks = 0;
+    for (int i = 0; i < (int)blocks.size(); i++)
+        if (!blocks[i])
+            free_blocks++;
+    return free_blocks;
+}
+
+// average nanoseconds per call of fn, result is kept alive through sink
+template <typename Fn>
+double timeIt(Fn fn, long long &sink)
+{
+    auto start = high_resolution_clock::now();
+    for (int r = 0; r < REPEATS; r++)
+        sink += fn();
+    auto stop = high_resolution_clock::now();
+    return duration_cast<nanoseconds>(stop - start).count() / (double)REPEATS;
+}
+
+void benchmark(int num_blocks)
+{
+    // a nearly full disk: an 8 block hole every 128 blocks, too short for the
+    // run search, and the only long enough run in the last 1% of the disk
+    vector<bool> bytes(num_blocks, true);
+    Bitmap bits(num_blocks);
+    bits.setRange(0, num_blocks);
+    auto freeBoth = [&](int start, int length)
+    {
+        bits.clearRange(start, length);
+        for (int j = start; j < start + length; j++)
+            bytes[j] = false;
+    };
+    for (int i = 64; i + 8 <= num_blocks; i += 128)
+        freeBoth(i, 8);
+    freeBoth(num_blocks - num_blocks / 100, RUN_LENGTH);
+
+    // a full disk with one free block half way, for the first free search
+    vector<bool> bytes_full(num_blocks, true);
+    Bitmap bits_full(num_blocks);
+    bits_full.setRange(0, num_blocks);
+    bytes_full[num_blocks / 2] = false;
+    bits_full.clear(num_blocks / 2);
+
+    long long sink = 0;
+    struct Row
+    {
+        string name;
+        double first_free, free_run, count_free;
+    };
+    vector<Row> rows;
+
+    rows.push_back({"one bool per block",
+                    timeIt([&]
+                           { return firstFreeBytes(bytes_full); }, sink),
+                    timeIt([&]
+                           { return freeRunBytes(bytes, RUN_LENGTH); }, sink),
+                    timeIt([&]
+                           { return countFreeBytes(bytes); }, sink)});
+    for (int mode = 0; mode < 3; mode++)
+    {
+        Bitmap::use_simd = mode > 0;
+        Bitmap::use_summary = mode == 2;
+        rows.push_back({mode == 0 ? "packed scalar" : mode == 1 ? "packed simd" : "simd + summary",
+                        timeIt([&]
+                               { return bits_full.findFirstFree(); }, sink),
+                        timeIt([&]
+                               { return bits.findFreeRun(RUN_LENGTH); }, sink),
+                        timeIt([&]
+                               { return bits.countFree(); }, sink)});
+    }
+    Bitmap::use_simd = true;
+    Bitmap::use_summary = true;
+
+    cout << "\n"
+         << num_blocks << " blocks (" << bits.memoryBytes() << " bytes packed)\n";
+    cout << "Method\t\t\t first free (ns)\t run of " << RUN_LENGTH << " (ns)\t free count (ns)\t speedup (first/run/count)\n";
+    cout << "=================================================================================================\n";
+    for (const auto &row : rows)
+    {
+        cout << row.name << (row.name.size() < 16 ? "\t\t " : "\t ")
+             << row.first_free << "\t\t " << row.free_run << "\t\t " << row.count_free << "\t\t "
+             << rows[0].first_free / row.first_free << "x / "
+             << rows[0].free_run / row.free_run << "x / "
+             << rows[0].count_free / row.count_free << "x\n";
+    }
+    if (sink == 42)
+        cout << "";
+}
+
+int main()
+{
+#ifndef __AVX2__
+    cout << "built without -mavx2, simd rows use the scalar path\n";
+#endif
+    benchmark(1 << 20);
+    benchmark(1 << 24);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "disk_geometry.h"
+
+// read-only window onto bytes of the device, valid while the device is open
+struct BlockView
+{
+    const char *data;
+    size_t size;
+};
+
+// Disk image in a local file, memory mapped so blocks can be read and
+// written in place. The image is created (sparse) or resized to match the
+// geometry when opened. Views point straight into the mapping, so reading a
+// contiguous run of blocks through view() copies nothing.
+class BlockDevice
+{
+public:
+    BlockDevice() : fd(-1), base(nullptr), geometry({0, 0}) {}
+    ~BlockDevice() { close(); }
+
+    BlockDevice(const BlockDevice &) = delete;
+    BlockDevice &operator=(const BlockDevice &) = delete;
+
+    bool open(const std::string &path, DiskGeometry disk)
+    {
+        close();
+        geometry = disk;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Error: could not open disk image " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (st.st_size != geometry.diskBytes() && ftruncate(fd, geometry.diskBytes()) != 0))
+        {
+            std::cerr << "Error: could not size disk image " << path << ": " << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        void *mapping = mmap(nullptr, geometry.diskBytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "Error: could not map disk image " << path << ": " << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        base = (char *)mapping;
+        return true;
+    }
+
+    void close()
+    {
+        if (base)
+            munmap(base, geometry.diskBytes());
+        if (fd >= 0)
+            ::close(fd);
+        base = nullptr;
+        fd = -1;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    int fileDescriptor() const { return fd; }
+    const DiskGeometry &diskGeometry() const { return geometry; }
+
+    // zero-copy view of count blocks starting at start_block
+    BlockView view(int start_block, int count) const
+    {
+        return {base + offsetOf(start_block), (size_t)count * geometry.block_size};
+    }
+
+    char *blockData(int block) { return base + offsetOf(block); }
+
+    // copy length bytes starting offset bytes into the run at start_block
+    void read(int start_block, long long offset, char *buffer, size_t length) const
+    {
+        memcpy(buffer, base + offsetOf(start_block) + offset, length);
+    }
+
+    void write(int start_block, long long offset, const char *data, size_t length)
+    {
+        memcpy(base + offsetOf(start_block) + offset, data, length);
+    }
+
+    // flush dirty pages of the mapping back to the image file
+    bool sync()
+    {
+        return !base || msync(base, geometry.diskBytes(), MS_SYNC) == 0;
+    }
+
+private:
+    int fd;
+    char *base; // start of the mapping
+    DiskGeometry geometry;
+
+    long long offsetOf(int block) const { return (long long)block * geometry.block_size; }
+};
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef CHAIN_READAHEAD_H
+#define CHAIN_READAHEAD_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include "allocation_table.h"
+
+// Readahead for the chain of a linked file in a disk image.
+//
+// Reading a chain one block at a time serializes the reads: the next block
+// is only known once the current one is done. The links are in the
+// allocation table in memory, though, so a prefetch thread can follow them
+// ahead of the reader. It asks the kernel for the blocks up to depth links
+// ahead (posix_fadvise WILLNEED, so those reads are in flight together),
+// preads each block into a slot of a single-producer single-consumer ring
+// and publishes it with an atomic store; the reader takes blocks off the
+// ring in order without a lock. A side that has to wait spins briefly,
+// then sleeps on a condition variable until the other side has moved its
+// index far enough; a full ring waits for half of it to drain, so the
+// prefetcher wakes once per burst of reads and not per block. The depth adapts to the reader: it doubles
+// whenever the reader finds the ring empty and halves after depth blocks in
+// a row that were all waiting for it, between MIN_DEPTH and RING_SLOTS.
+// One stream at a time, from one reading thread.
+class ChainReadahead
+{
+public:
+    static constexpr int RING_SLOTS = 64; // blocks the prefetcher can be ahead, at most
+    static constexpr int MIN_DEPTH = 4;
+    static constexpr int SPINS = 64; // yields before a waiting side goes to sleep
+
+    ChainReadahead(const AllocationTable &table, int fd, int block_size)
+        : table(table), fd(fd), block_size(block_size), slots(new char[(size_t)RING_SLOTS * block_size]) {}
+
+    ~ChainReadahead()
+    {
+        {
+            std::lock_guard<std::mutex> guard(stream_mutex);
+            quit = true;
+        }
+        stream_ready.notify_all();
+        if (prefetcher.joinable())
+            prefetcher.join();
+    }
+
+    ChainReadahead(const ChainReadahead &) = delete;
+    ChainReadahead &operator=(const ChainReadahead &) = delete;
+
+    // Streams num_blocks blocks of the chain from first_block, calling
+    // fn(data, block) for each in chain order with the block's bytes in the
+    // ring. Returns the blocks read, -1 if a read failed.
+    template <typename Fn>
+    long long stream(int first_block, long long num_blocks, Fn fn)
+    {
+        if (num_blocks <= 0)
+            return 0;
+        if (!prefetcher.joinable())
+            prefetcher = std::thread([this]
+                                     { prefetch(); });
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(stream_mutex);
+            stream_first = first_block;
+            stream_blocks = num_blocks;
+            stream_id++;
+        }
+        stream_ready.notify_one();
+
+        bool failed = false;
+        int full_run = 0; // blocks in a row that were ready before the reader wanted them
+        for (long long i = 0; i < num_blocks; i++)
+        {
+            long long ready = tail.load(std::memory_order_acquire) - i;
+            if (ready == 0)
+            {
+                stall_count++;
+                full_run = 0;
+                depth.store(std::min(depth.load(std::memory_order_relaxed) * 2, RING_SLOTS), std::memory_order_relaxed);
+                waitFor(tail, i + 1, reader_sleep);
+            }
+            else if (ready >= depth.load(std::memory_order_relaxed) && ++full_run >= depth.load(std::memory_order_relaxed))
+            {
+                full_run = 0;
+                depth.store(std::max(depth.load(std::memory_order_relaxed) / 2, MIN_DEPTH), std::memory_order_relaxed);
+            }
+            int slot = (int)(i % RING_SLOTS);
+            if (slot_block[slot] < 0)
+                failed = true;
+            else
+                fn((const char *)slots.get() + (size_t)slot * block_size, slot_block[slot]);
+            head.store(i + 1); // seq_cst, see wake()
+            wake(i + 1, prefetcher_sleep);
+        }
+        max_depth = std::max(max_depth, depth.load(std::memory_order_relaxed));
+        return failed ? -1 : num_blocks;
+    }
+
+    // pread one whole block of the image into buffer, false on an error or a short image
+    static bool readBlock(int fd, int block, int block_size, char *buffer)
+    {
+        for (size_t done = 0; done < (size_t)block_size;)
+        {
+            ssize_t got = pread(fd, buffer + done, block_size - done, (off_t)block * block_size + done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            done += got;
+        }
+        return true;
+    }
+
+    int currentDepth() const { return depth.load(std::memory_order_relaxed); }
+    int maxDepth() const { return max_depth; }
+    long long stalls() const { return stall_count; } // times the reader found nothing to read
+
+private:
+    const AllocationTable &table;
+    int fd;
+    int block_size;
+    std::unique_ptr<char[]> slots;
+    int slot_block[RING_SLOTS]; // block in each slot, -1 if its read failed
+
+    std::atomic<long long> head{0}; // blocks the reader is done with
+    std::atomic<long long> tail{0}; // blocks read into the ring
+    std::atomic<int> depth{MIN_DEPTH};
+    int max_depth = MIN_DEPTH;
+    long long stall_count = 0;
+
+    std::thread prefetcher;
+    std::mutex stream_mutex; // guards the stream request below
+    std::condition_variable stream_ready;
+    int stream_first = -1;
+    long long stream_blocks = 0;
+    long long stream_id = 0;
+    bool quit = false;
+
+    // one side sleeping until the other side's index reaches target
+    struct Sleeper
+    {
+        std::atomic<long long> target{LLONG_MAX}; // LLONG_MAX while awake
+        std::condition_variable moved;
+    };
+    std::mutex ring_mutex; // only taken to go to sleep or to wake a sleeper
+    Sleeper reader_sleep, prefetcher_sleep;
+
+    // Waits until index reaches target. The yields let the other side run on
+    // a busy or single CPU; after SPINS of them the caller sleeps until the
+    // other side's wake() gets the index there.
+    void waitFor(const std::atomic<long long> &index, long long target, Sleeper &sleeper)
+    {
+        for (int spin = 0; spin < SPINS; spin++)
+        {
+            if (index.load(std::memory_order_acquire) >= target)
+                return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> guard(ring_mutex);
+        sleeper.target.store(target); // seq_cst: wake() sees the target or we see its index
+        sleeper.moved.wait(guard, [&]
+                           { return index.load() >= target; });
+        sleeper.target.store(LLONG_MAX, std::memory_order_relaxed);
+    }
+
+    // called after moving an index to value, wakes the other side if it sleeps until then
+    void wake(long long value, Sleeper &sleeper)
+    {
+        if (value < sleeper.target.load()) // seq_cst, after the seq_cst store of the index
+            return;
+        {
+            std::lock_guard<std::mutex> guard(ring_mutex); // the sleeper is waiting or has not checked yet
+        }
+        sleeper.moved.notify_one();
+    }
+
+    // the prefetch thread: one stream after another until quit
+    void prefetch()
+    {
+        long long served = 0;
+        while (true)
+        {
+            int block;
+            long long num_blocks;
+            {
+                std::unique_lock<std::mutex> guard(stream_mutex);
+                stream_ready.wait(guard, [&]
+                                  { return quit || stream_id != served; });
+                if (quit)
+                    return;
+                served = stream_id;
+                block = stream_first;
+                num_blocks = stream_blocks;
+            }
+
+            int advised = block; // last block handed to the kernel ahead of the reads
+            long long advised_count = 0;
+            for (long long i = 0; i < num_blocks; i++)
+            {
+                int ahead = depth.load(std::memory_order_relaxed);
+                if (i - head.load(std::memory_order_acquire) >= ahead)
+                    waitFor(head, i - ahead / 2 + 1, prefetcher_sleep); // a full ring waits for half of it to drain
+                // keep the kernel busy with the blocks up to depth links ahead
+                for (long long limit = std::min(i + depth.load(std::memory_order_relaxed), num_blocks); advised_count < limit; advised_count++)
+                {
+                    if (advised_count > 0)
+                        advised = table.next(advised);
+                    posix_fadvise(fd, (off_t)advised * block_size, block_size, POSIX_FADV_WILLNEED);
+                }
+                int slot = (int)(i % RING_SLOTS);
+                slot_block[slot] = readBlock(fd, block, block_size, slots.get() + (size_t)slot * block_size) ? block : -1;
+                // the table may change once the reader has the last block
+                int after = i + 1 < num_blocks ? table.next(block) : -1;
+                tail.store(i + 1); // seq_cst, see wake()
+                wake(i + 1, reader_sleep);
+                block = after;
+            }
+        }
+    }
+};
+
+#endif
@@ -4,46 +4,93 @@
 #include <chrono> // for time stamps
 #include <iostream>
 #include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+#include "batch.h"
+#include "bitmap.h"
+#include "block_device.h"
+#include "directory_index.h"
+#include "disk_geometry.h"
+#include "extent_reader.h"
+#include "free_extent_index.h"
+#include "latency_histogram.h"
+#include "scaling_benchmark.h"
 using namespace std;
 using namespace std::chrono; // for time stamps
-const int BLOCK_SIZE = 4096; // block size in bytes
-const int NUM_BLOCKS = 512;  // total number of blocks on the disk
+const DiskGeometry DEFAULT_GEOMETRY = {4096, 512}; // 4 KB blocks, 512 blocks on the disk
 
-int blocks[NUM_BLOCKS];
+DiskGeometry geometry = DEFAULT_GEOMETRY;
+Bitmap blocks(DEFAULT_GEOMETRY.num_blocks); // set bit = allocated block
+FreeExtentIndex freeRuns;                   // run-length map of the free space, kept next to the bitmap
+bool log_ops = true;                        // print a line per operation, turned off for benchmarks
+BlockDevice device;                         // backing image for file data, optional
+ExtentReader extentReader;                  // batched reads of file extents from the image
+OpMetrics op_metrics;                       // counters and latency histograms of every operation
+bool delayed_allocation = false;            // extendAllocate only reserves, blocks are placed at flush
+long long reservedBlocks = 0;               // blocks promised to delayed extensions, not placed yet
+long long delallocLimit = 1024;             // pending blocks that force a flush (memory pressure)
+vector<string> pendingFiles;                // files that may hold a delayed extension
+int reservationWindow = 64;                 // free blocks held after a growing file for its next appends
+long long windowedBlocks = 0;               // free blocks held in reservation windows
 
 struct Block
 {
     int data1;
     int data2;
 };
-int blockContent[NUM_BLOCKS];
+// one contiguous piece of a file on disk
+struct fileExtent
+{
+    int startBlock; // first physical block
+    int noBlocks;
+};
 struct file
 {
     string fileName;
     int startBlock;
+    map<long long, fileExtent> extents = {}; // block offset within the file -> where those blocks are, in file order
+    long long noBlocks = 0;         // blocks in the file, also the offset of the next extension
+    long long pendingBlocks = 0;    // appended under delayed allocation, not placed on disk yet
+    bool pendingListed = false;     // the name is in pendingFiles
+    int windowStart = -1;           // reservation window right after the last extent
+    int windowBlocks = 0;
 };
-vector<file> directory;
+DirectoryIndex<file, &file::fileName> directory; // hashed by file name
 
-struct allocate
+// start over with an empty disk of the given geometry
+void formatDisk(DiskGeometry g)
 {
-    string fileName;
-    int startBlock;
-    int endBlock;
-    bool isExtend; // if this allocation is extended
-    int extention; // first index of extention
-};
-vector<allocate> allocations;
+    geometry = g;
+    blocks = Bitmap(g.num_blocks);
+    freeRuns = FreeExtentIndex();
+    freeRuns.insert(0, g.num_blocks);
+    directory.clear();
+    reservedBlocks = 0;
+    pendingFiles.clear();
+    windowedBlocks = 0;
+    op_metrics.reset();
+}
+
 // takes size of contigous allocation in no of blocks to be intialized and extended
 // checks if possible to allocate, returns index of first block of such
-// a contigous space if possible, else return -1
+// a contigous space if possible, else return -1. The first fit comes from
+// the run-length map in O(log free runs).
 int isPossible(int sz)
 {
-    for (int i = 0; i < NUM_BLOCKS; i++)
+    return freeRuns.find(sz, FitPolicy::FIRST_FIT);
+}
+
+// the original scan, restarting at every block; kept to benchmark against
+int isPossibleScan(int sz)
+{
+    for (int i = 0; i < geometry.num_blocks; i++)
     {
         int cnt = 0;
-        for (int j = i; j < NUM_BLOCKS; j++)
+        for (int j = i; j < geometry.num_blocks; j++)
         {
-            if (blocks[j] == 0)
+            if (!blocks.test(j))
                 cnt++;
             else
                 break;
@@ -54,144 +101,666 @@ int isPossible(int sz)
     return -1;
 }
 
-void allocateBlocks(string fileName, int noBlocks, int ind)
+void freeBlocks(int startBlock, int noBlocks)
+{
+    blocks.clearRange(startBlock, noBlocks);
+    freeRuns.insert(startBlock, noBlocks);
+}
+
+// append noBlocks blocks starting at ind to the end of f, an extension that
+// starts right where the last extent ends just makes that extent longer
+void allocateBlocks(file &f, int noBlocks, int ind)
+{
+    blocks.setRange(ind, noBlocks);
+    freeRuns.remove(ind, noBlocks);
+    if (noBlocks == 0)
+        return;
+    if (!f.extents.empty())
+    {
+        fileExtent &last = f.extents.rbegin()->second;
+        if (last.startBlock + last.noBlocks == ind)
+        {
+            last.noBlocks += noBlocks;
+            f.noBlocks += noBlocks;
+            return;
+        }
+    }
+    f.extents.emplace_hint(f.extents.end(), f.noBlocks, fileExtent{ind, noBlocks});
+    f.noBlocks += noBlocks;
+}
+
+// give every extent of f back to the free space
+void freeFile(const file &f)
 {
-    for (int i = ind; i < ind + noBlocks; i++)
-        blocks[i] = 1;
-    allocate a;
-    a.fileName = fileName;
-    a.startBlock = ind;
-    a.endBlock = ind + noBlocks - 1;
-    a.isExtend = false;
-    allocations.push_back(a);
+    for (const auto &e : f.extents)
+        freeBlocks(e.second.startBlock, e.second.noBlocks);
+}
+
+// blocks that can still be promised: free blocks, windows included, not
+// reserved by delayed extensions
+long long unreservedBlocks()
+{
+    return freeRuns.freeBlocks() + windowedBlocks - reservedBlocks;
+}
+
+// first block after the last extent of f, -1 if it has none
+int endOf(const file &f)
+{
+    if (f.extents.empty())
+        return -1;
+    const fileExtent &last = f.extents.rbegin()->second;
+    return last.startBlock + last.noBlocks;
+}
+
+// Soft reservation for a growing file: up to reservationWindow free blocks
+// right after its last extent are taken out of the run map, so other
+// allocations pass them by and the file's next appends land next to it.
+// The blocks stay free in the bitmap and count as free space; windows are
+// given back when the file is extended, deleted or space runs short.
+void openWindow(file &f)
+{
+    int end = endOf(f);
+    if (reservationWindow <= 0 || end == -1)
+        return;
+    int length = min(reservationWindow, freeRuns.runAt(end));
+    if (length == 0)
+        return;
+    freeRuns.remove(end, length);
+    f.windowStart = end;
+    f.windowBlocks = length;
+    windowedBlocks += length;
+}
+
+void releaseWindow(file &f)
+{
+    if (f.windowBlocks == 0)
+        return;
+    freeRuns.insert(f.windowStart, f.windowBlocks);
+    windowedBlocks -= f.windowBlocks;
+    f.windowBlocks = 0;
+}
+
+// give every window back, when an allocation cannot be met without them
+void releaseWindows()
+{
+    for (auto &f : directory)
+    {
+        if (windowedBlocks == 0)
+            break;
+        releaseWindow(f);
+    }
+}
+
+// place the delayed extension of f: in one extent when some run is long
+// enough, otherwise in the largest runs there are. Cannot run out of space,
+// the blocks were reserved from the free count.
+void flushFile(file &f)
+{
+    long long left = f.pendingBlocks;
+    reservedBlocks -= left;
+    f.pendingBlocks = 0;
+    releaseWindow(f);
+    if (left > freeRuns.freeBlocks())
+        releaseWindows();
+    int end = endOf(f);
+    if (end != -1 && freeRuns.runAt(end) >= left)
+    {
+        allocateBlocks(f, (int)left, end);
+        left = 0;
+    }
+    while (left > 0)
+    {
+        int noBlocks = (int)min(left, (long long)freeRuns.largestExtent());
+        allocateBlocks(f, noBlocks, isPossible(noBlocks));
+        left -= noBlocks;
+    }
+    openWindow(f);
+}
+
+// place every delayed extension, under memory pressure or before an
+// allocation that needs the reserved blocks
+void flushAll()
+{
+    for (const string &name : pendingFiles)
+        if (file *f = directory.find(name))
+        {
+            flushFile(*f);
+            f->pendingListed = false;
+        }
+    pendingFiles.clear();
+}
+
+// first fit for noBlocks that leaves enough free blocks for the delayed
+// extensions, flushing them first when they are in the way and taking the
+// reservation windows back when no run is long enough without them
+int findRun(long long noBlocks)
+{
+    if (noBlocks > unreservedBlocks() && reservedBlocks > 0)
+        flushAll();
+    if (noBlocks > unreservedBlocks())
+        return -1;
+    int ind = isPossible((int)noBlocks);
+    if (ind == -1 && windowedBlocks > 0)
+    {
+        releaseWindows();
+        ind = isPossible((int)noBlocks);
+    }
+    return ind;
+}
+
+// where the next noBlocks of f go: right after its last extent (its window
+// given back first) when the run there is long enough, else the first fit
+int findAppendRun(file &f, long long noBlocks)
+{
+    releaseWindow(f);
+    int end = endOf(f);
+    if (end != -1 && noBlocks <= unreservedBlocks() && freeRuns.runAt(end) >= noBlocks)
+        return end;
+    return findRun(noBlocks);
+}
+
+// the file with its delayed extension placed, for anything that touches its blocks
+file *findPlaced(const string &fileName)
+{
+    file *f = directory.find(fileName);
+    if (f && f->pendingBlocks)
+        flushFile(*f);
+    return f;
+}
+
+bool isPresent(string fileName)
+{
+    return directory.find(fileName) != nullptr;
 }
 
 // size is in terms of byte here
-void initAllocate(string fileName, int size)
+bool initAllocate(string fileName, long long size)
 {
-    auto start = high_resolution_clock::now(); // start time stamp
-    int noBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    OpTimer timer(op_metrics, Op::CREATE);
+    long long noBlocks = geometry.blocksFor(size);
 
-    int ind = isPossible(noBlocks);
+    if (isPresent(fileName))
+    {
+        if (log_ops)
+            cout << "File named :" << fileName << " already exists and hence cannot be intialized\n";
+        return false;
+    }
+    int ind = findRun(noBlocks);
     if (ind == -1)
     {
-        cout << "File named :" << fileName << " cannot be intialized with size :" << size << " bytes\n";
-        return;
+        if (log_ops)
+            cout << "File named :" << fileName << " cannot be intialized with size :" << size << " bytes\n";
+        return false;
     }
 
     file f;
     f.fileName = fileName;
     f.startBlock = ind;
-    directory.push_back(f);
-    allocateBlocks(fileName, noBlocks, ind);
-    auto stop = high_resolution_clock::now();                 // stop time stamp
-    auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-    cout << fileName << " got initialized in " << duration.count() << " nanoseconds\n";
+    allocateBlocks(directory.insert(f), noBlocks, ind);
+    if (log_ops)
+        cout << fileName << " got initialized\n";
+    timer.succeeded();
+    return true;
 }
 
-bool isPresent(string fileName)
+void extendAllocate(string fileName, long long size)
+{
+    OpTimer timer(op_metrics, Op::EXTEND);
+    long long noBlocks = geometry.blocksFor(size);
+    file *f = directory.find(fileName);
+    if (!f)
+    {
+        if (log_ops)
+            cout << "error, no such file named : " << fileName << " on disk and hence cannot be extended\n";
+        return;
+    }
+    if (delayed_allocation)
+    {
+        // only count the blocks now, they get placed together at flush
+        if (noBlocks > unreservedBlocks())
+        {
+            if (log_ops)
+                cout << "File named :" << fileName << " cannot be extended with size :" << size << " bytes\n";
+            return;
+        }
+        // listed once, a flush on read or write leaves the name in the list
+        if (!f->pendingListed)
+            pendingFiles.push_back(fileName);
+        f->pendingListed = true;
+        f->pendingBlocks += noBlocks;
+        reservedBlocks += noBlocks;
+        if (reservedBlocks > delallocLimit)
+            flushAll();
+        if (log_ops)
+            cout << fileName << " got extended (delayed)\n";
+        timer.succeeded();
+        return;
+    }
+    int ind = findAppendRun(*f, noBlocks);
+    if (ind == -1)
+    {
+        if (log_ops)
+            cout << "File named :" << fileName << " cannot be extended with size :" << size << " bytes\n";
+        return;
+    }
+
+    allocateBlocks(*f, noBlocks, ind);
+    openWindow(*f);
+    if (log_ops)
+        cout << fileName << " got extended\n";
+    timer.succeeded();
+}
+
+// close fileName: its delayed extension gets placed now
+bool closeFile(string fileName)
 {
-    for (auto x : directory)
-        if (x.fileName == fileName)
-            return true;
-    return false;
+    file *f = findPlaced(fileName);
+    if (!f)
+        return false;
+    if (f->pendingListed)
+        pendingFiles.erase(remove(pendingFiles.begin(), pendingFiles.end(), fileName), pendingFiles.end());
+    f->pendingListed = false;
+    return true;
 }
 
-void extendAllocate(string fileName, int size)
+// zero-copy view of the blocks of one extent, data is null without a device
+BlockView viewThisAllocation(const fileExtent &e)
 {
-    auto start = high_resolution_clock::now(); // start time stamp
-    int noBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int ind = isPossible(noBlocks);
+    if (!device.isOpen())
+        return {nullptr, (size_t)e.noBlocks * geometry.block_size};
+    return device.view(e.startBlock, e.noBlocks);
+}
 
-    if (ind == -1)
+// the read of up to length bytes of extent e from the image into buffer
+ExtentRead extentRead(const fileExtent &e, char *buffer, long long length)
+{
+    long long offset = (long long)e.startBlock * geometry.block_size;
+    return {offset, buffer, (size_t)min(length, (long long)e.noBlocks * geometry.block_size)};
+}
+
+// read up to length bytes of one extent from the image into buffer with a
+// single pread, returns the bytes read or -1
+long long readThisAllocation(const fileExtent &e, char *buffer, long long length)
+{
+    if (!device.isOpen())
+        return -1;
+    return ExtentReader::readEach(device.fileDescriptor(), {extentRead(e, buffer, length)});
+}
+
+void readFile(string fileName)
+{
+    OpTimer timer(op_metrics, Op::READ);
+    const file *f = findPlaced(fileName);
+    if (!f)
     {
-        cout << "File named :" << fileName << " cannot be extended with size :" << size << " bytes\n";
+        if (log_ops)
+            cout << "error, no such file named : " << fileName << " on disk and hence cannot be read\n";
         return;
     }
-    if (!isPresent(fileName))
+    long long cnt = 0;   // no of blocks in the file
+    long long bytes = 0; // bytes handed out by the views
+    for (const auto &e : f->extents)
     {
-        cout << "error, no such file named : " << fileName << " on disk and hence cannot be extended\n";
-        return;
+        cnt += e.second.noBlocks;
+        // read this extent
+        bytes += viewThisAllocation(e.second).size;
+    }
+    if (log_ops)
+    {
+        cout << "read " << cnt << " blocks and " << bytes << " bytes of " << fileName << "\n";
+        cout << fileName << " got read\n";
+    }
+    timer.succeeded();
+}
+
+void deleteFile(string fileName)
+{
+    OpTimer timer(op_metrics, Op::DELETE);
+    file *f = directory.find(fileName);
+    if (f)
+    {
+        releaseWindow(*f);
+        freeFile(*f);
+        reservedBlocks -= f->pendingBlocks;
+        directory.erase(fileName);
+        timer.succeeded();
     }
+    if (log_ops)
+        cout << fileName << " got deleted\n";
+}
 
-    for (auto &a : allocations)
+// initialize many files at once: the free runs are walked once in address
+// order and every run is filled with the largest waiting files that fit.
+// Existing names fail like in initAllocate; of a name repeated inside the
+// batch only the first request counts, the later ones fail.
+vector<bool> createBatch(const vector<CreateRequest> &requests)
+{
+    OpTimer timer(op_metrics, Op::CREATE_BATCH);
+    timer.succeeded();
+    vector<bool> results(requests.size(), false);
+    // the runs below are handed out without looking at reservations or windows
+    flushAll();
+    releaseWindows();
+    set<pair<long long, int>> waiting; // (blocks, request)
+    for (int i : uniqueSizeOrder(requests, true))
+        if (!isPresent(requests[i].name))
+            waiting.insert({geometry.blocksFor(requests[i].size), i});
+
+    directory.reserve(directory.size() + waiting.size());
+    for (int ind = blocks.findFirstFree(); ind != -1 && !waiting.empty();)
     {
-        if (a.fileName == fileName && a.isExtend == false)
+        int runEnd = blocks.findFirstUsed(ind);
+        while (!waiting.empty())
         {
-            a.isExtend = true;
-            a.extention = ind;
+            auto fit = waiting.upper_bound({runEnd - ind, INT_MAX});
+            if (fit == waiting.begin())
+                break;
+            --fit;
+            const CreateRequest &request = requests[fit->second];
+            allocateBlocks(directory.insert({request.name, ind}), (int)fit->first, ind);
+            results[fit->second] = true;
+            ind += (int)fit->first;
+            waiting.erase(fit);
         }
+        ind = runEnd < geometry.num_blocks ? blocks.findFirstFree(runEnd) : -1;
     }
-    allocateBlocks(fileName, noBlocks, ind);
-    auto stop = high_resolution_clock::now();                 // stop time stamp
-    auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-    cout << fileName << " got extended in " << duration.count() << " nanoseconds\n";
+
+    if (log_ops)
+        cout << "batch of " << requests.size() << " files (" << count(results.begin(), results.end(), true)
+             << " initialized)\n";
+    return results;
 }
 
-void readThisAllocation(allocate a)
+// delete many files, touching only their own extents
+vector<bool> deleteBatch(const vector<string> &fileNames)
 {
-    for (int i = a.startBlock; i <= a.endBlock; i++)
+    OpTimer timer(op_metrics, Op::DELETE_BATCH);
+    timer.succeeded();
+    vector<bool> results(fileNames.size(), false);
+    int deleted = 0;
+    for (size_t i = 0; i < fileNames.size(); i++)
     {
-        // read the block data ( refer blockData global array)
+        file *f = directory.find(fileNames[i]);
+        if (!f)
+            continue;
+        releaseWindow(*f);
+        freeFile(*f);
+        reservedBlocks -= f->pendingBlocks;
+        directory.erase(fileNames[i]);
+        results[i] = true;
+        deleted++;
     }
+    if (log_ops)
+        cout << "batch of " << deleted << " files got deleted\n";
+    return results;
 }
 
-void readFile(string fileName)
+// write data over the extents of an existing file, in order, up to its allocated size
+bool writeFile(string fileName, const string &data)
 {
-    if (!isPresent(fileName))
+    const file *f = findPlaced(fileName);
+    if (!f || !device.isOpen())
     {
-        cout << "error, no such file named : " << fileName << " on disk and hence cannot be read\n";
-        return;
+        if (log_ops)
+            cout << "error, " << fileName << " cannot be written (no such file or no device)\n";
+        return false;
     }
-    auto start = high_resolution_clock::now(); // start time stamp
-    int cnt = 0;                               // no of blocks in the file
-    for (auto a : allocations)
+    size_t written = 0;
+    for (const auto &e : f->extents)
     {
-        if (a.fileName == fileName && a.isExtend == false)
-        {
-            cnt += (a.endBlock - a.startBlock) + 1;
-            // done reading
-            readThisAllocation(a);
+        if (written == data.size())
             break;
-        }
-        if (a.fileName == fileName)
+        size_t length = min(data.size() - written, (size_t)e.second.noBlocks * geometry.block_size);
+        device.write(e.second.startBlock, 0, data.data() + written, length);
+        written += length;
+    }
+    if (written < data.size() && log_ops)
+        cout << "only " << written << " of " << data.size() << " bytes fit in " << fileName << "\n";
+    return written == data.size();
+}
+
+// copy up to length bytes of a file into buffer, returns the bytes copied or -1.
+// The reads of all extents are submitted together, see ExtentReader.
+long long readFileData(string fileName, char *buffer, long long length)
+{
+    const file *f = findPlaced(fileName);
+    if (!f || !device.isOpen())
+        return -1;
+    vector<ExtentRead> reads;
+    reads.reserve(f->extents.size());
+    long long queued = 0;
+    for (const auto &e : f->extents)
+    {
+        if (queued == length)
+            break;
+        reads.push_back(extentRead(e.second, buffer + queued, length - queued));
+        queued += reads.back().length;
+    }
+    return extentReader.read(device.fileDescriptor(), reads);
+}
+
+// Copy up to length bytes of a file from byte offset on into buffer, returns
+// the bytes read (0 at or past the end) or -1 if there is no such file. The
+// extent holding the offset is found in the file's extent map in
+// O(log extents), the read then carries on into the extents after it.
+// Without a device the bytes are counted but not copied. Unlike the other
+// layouts, an extended file has no byte size, only blocks, so a read can
+// go on to the end of its last block.
+long long preadFile(string fileName, long long offset, char *buffer, long long length)
+{
+    OpTimer timer(op_metrics, Op::PREAD);
+    const file *f = findPlaced(fileName);
+    if (!f || offset < 0)
+        return -1;
+    long long bytes = max(0LL, min(length, f->noBlocks * geometry.block_size - offset));
+    long long done = 0;
+    if (bytes > 0)
+    {
+        auto e = prev(f->extents.upper_bound(offset / geometry.block_size));
+        long long within = offset - e->first * geometry.block_size; // bytes into extent e
+        for (; done < bytes; ++e, within = 0)
         {
-            cnt += (a.endBlock - a.startBlock) + 1;
-            // read this allocation
-            readThisAllocation(a);
+            long long piece = min(bytes - done, (long long)e->second.noBlocks * geometry.block_size - within);
+            if (device.isOpen())
+                device.read(e->second.startBlock, within, buffer + done, piece);
+            done += piece;
         }
     }
-    cout << "read " << cnt << " blocks and " << cnt * BLOCK_SIZE << " bytes of " << fileName << "\n";
-    auto stop = high_resolution_clock::now();                 // stop time stamp
-    auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-    cout << fileName << " got read in " << duration.count() << " nanoseconds\n";
+    timer.succeeded();
+    return done;
 }
 
-void deleteFile(string fileName)
+// bytes of in-memory metadata: block map, free run map, directory and extent maps
+size_t metadataBytes()
 {
-    auto start = high_resolution_clock::now(); // start time stamp
-    for (auto it = directory.begin(); it != directory.end(); it++)
+    size_t bytes = blocks.memoryBytes() + freeRuns.memoryBytes() + directory.memoryBytes() +
+                   pendingFiles.capacity() * sizeof(string);
+    for (const auto &f : directory)
+        bytes += f.extents.size() * (sizeof(pair<const long long, fileExtent>) + 32); // map node with its tree links
+    return bytes;
+}
+
+// Time to find the first run of RUN blocks on a disk with one used block
+// every RUN blocks (so every free run is one block too short) and a single
+// long enough run near the end: the old scan, the bitmap run search and
+// the run-length map.
+void runFreeSpaceBenchmark()
+{
+    const int RUN = 64;
+    cout << "\ncontiguous extended free run search (first run of " << RUN << " blocks)\n";
+    cout << "Blocks\t\t Scan (ns)\t Bitmap (ns)\t Run map (ns)\t Speedup vs scan\n";
+    cout << "=================================================================================\n";
+    for (int num_blocks : {1 << 16, 1 << 20})
     {
-        if ((*it).fileName == fileName)
-            directory.erase(it);
+        formatDisk({geometry.block_size, num_blocks});
+        file &pins = directory.insert({"pins", RUN - 1});
+        int hole = num_blocks - num_blocks / 100 / RUN * RUN - RUN;
+        for (int i = RUN - 1; i < num_blocks; i += RUN)
+            if (i < hole || i >= hole + 2 * RUN)
+                allocateBlocks(pins, 1, i);
+
+        auto nsPerCall = [](int repeats, auto fn)
+        {
+            int found = 0;
+            auto start = high_resolution_clock::now();
+            for (int r = 0; r < repeats; r++)
+                found += fn() != -1;
+            double ns = duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / repeats;
+            return found == repeats ? ns : -1;
+        };
+        double scan = nsPerCall(3, []
+                                { return isPossibleScan(RUN); });
+        double bitmap = nsPerCall(100, []
+                                  { return blocks.findFreeRun(RUN); });
+        double runMap = nsPerCall(100000, []
+                                  { return isPossible(RUN); });
+        cout << num_blocks << (num_blocks < 10000000 ? "\t\t " : "\t ") << (long long)scan << "\t " << (long long)bitmap
+             << "\t\t " << runMap << "\t\t " << (long long)(scan / runMap) << "x\n";
     }
-    for (auto it = allocations.begin(); it != allocations.end(); it++)
+}
+
+// Time to read a file of EXTENTS extents of RUN blocks each from the image:
+// one pread per block, one pread per extent and all extents submitted at
+// once through the ExtentReader (io_uring when the kernel allows it).
+void runExtentReadBenchmark(const string &image)
+{
+    const int EXTENTS = 256, RUN = 4, REPEATS = 200;
+    formatDisk({geometry.block_size, 4 * EXTENTS * RUN});
+    if (!device.open(image, geometry))
+        return;
+    int saved_window = reservationWindow;
+    reservationWindow = 0; // a window would merge the extensions into a few extents
+    long long runBytes = (long long)RUN * geometry.block_size;
+    initAllocate("fragmented", runBytes);
+    for (int i = 1; i < EXTENTS; i++)
+    {
+        initAllocate("gap" + to_string(i), geometry.block_size); // keeps the extensions apart
+        extendAllocate("fragmented", runBytes);
+    }
+    reservationWindow = saved_window;
+    const file *f = directory.find("fragmented");
+    long long length = f->noBlocks * geometry.block_size;
+    writeFile("fragmented", string(length, 'x'));
+
+    vector<char> buffer(length);
+    vector<ExtentRead> blockReads, extentReads;
+    for (const auto &e : f->extents)
     {
-        if ((*it).fileName == fileName)
+        extentReads.push_back(extentRead(e.second, buffer.data() + e.first * geometry.block_size, length));
+        for (int b = 0; b < e.second.noBlocks; b++)
+            blockReads.push_back({extentReads.back().offset + (long long)b * geometry.block_size,
+                                  extentReads.back().buffer + (long long)b * geometry.block_size, (size_t)geometry.block_size});
+    }
+    auto usPerRead = [&](auto read)
+    {
+        bool complete = true;
+        auto start = high_resolution_clock::now();
+        for (int r = 0; r < REPEATS; r++)
+            complete &= read() == length;
+        double us = duration_cast<duration<double, micro>>(high_resolution_clock::now() - start).count() / REPEATS;
+        return complete ? us : -1;
+    };
+    int fd = device.fileDescriptor();
+    double perBlock = usPerRead([&]
+                                { return ExtentReader::readEach(fd, blockReads); });
+    double perExtent = usPerRead([&]
+                                 { return ExtentReader::readEach(fd, extentReads); });
+    double batched = usPerRead([&]
+                               { return readFileData("fragmented", buffer.data(), length); });
+    bool intact = count(buffer.begin(), buffer.end(), 'x') == length;
+
+    cout << "\ncontiguous extended extent reads (" << f->extents.size() << " extents, " << length / 1024 << " KB)\n";
+    cout << "Path\t\t\t System calls\t Time (us)\n";
+    cout << "==============================================\n";
+    cout << "pread per block\t\t " << blockReads.size() << "\t\t " << perBlock << "\n";
+    cout << "pread per extent\t " << extentReads.size() << "\t\t " << perExtent << "\n";
+    cout << (extentReader.batched() ? "io_uring batch\t\t " : "fallback (pread)\t ")
+         << (extentReader.batched() ? (extentReads.size() + ExtentReader::QUEUE_DEPTH - 1) / ExtentReader::QUEUE_DEPTH : extentReads.size())
+         << "\t\t " << batched << "\n";
+    cout << "data read back intact: " << (intact ? "yes" : "NO") << "\n";
+    device.close();
+}
+
+// Append-heavy logs: LOGS files grow one block at a time in turn, the way
+// interleaved log writers do. Immediate allocation without windows puts
+// every append in its own extent. Reservation windows keep a file's next
+// appends next to it, and delayed allocation places a file's appends
+// together at each flush, so the extent count drops with the window size
+// and the pending limit.
+void runAppendBenchmark()
+{
+    const int LOGS = 64, APPENDS = 256;
+    cout << "\ncontiguous extended appends (" << LOGS << " logs, " << APPENDS << " one block appends each)\n";
+    cout << "Mode\t\t Pending limit\t Window\t Extents/file\t Max extents\t Time per append (ns)\n";
+    cout << "===========================================================================================\n";
+    bool saved_mode = delayed_allocation;
+    long long saved_limit = delallocLimit;
+    int saved_window = reservationWindow;
+    const pair<long long, int> modes[] = {{0, 0}, {0, 8}, {0, 64}, {1024, 0}, {4096, 0}, {(long long)LOGS * APPENDS, 0}, {1024, 64}};
+    for (auto [limit, window] : modes)
+    {
+        delayed_allocation = limit > 0;
+        delallocLimit = limit;
+        reservationWindow = window;
+        formatDisk({geometry.block_size, 4 * LOGS * APPENDS});
+        for (int l = 0; l < LOGS; l++)
+            initAllocate("log" + to_string(l), geometry.block_size);
+        auto start = high_resolution_clock::now();
+        for (int a = 0; a < APPENDS; a++)
+            for (int l = 0; l < LOGS; l++)
+                extendAllocate("log" + to_string(l), geometry.block_size);
+        for (int l = 0; l < LOGS; l++)
+            closeFile("log" + to_string(l));
+        double ns = duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / (LOGS * APPENDS);
+
+        size_t extents = 0, most = 0;
+        for (const auto &f : directory)
         {
-            for (int i = (*it).startBlock; i <= (*it).endBlock; i++)
-                blocks[i] = 0;
-            allocations.erase(it);
+            extents += f.extents.size();
+            most = max(most, f.extents.size());
         }
+        cout << (delayed_allocation ? "delayed\t\t " : "immediate\t ") << limit << "\t\t " << window << "\t "
+             << (double)extents / LOGS << "\t\t " << most << "\t\t " << (long long)ns << "\n";
     }
-    auto stop = high_resolution_clock::now();                 // stop time stamp
-    auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-    cout << fileName << " got deleted in " << duration.count() << " nanoseconds\n";
+    delayed_allocation = saved_mode;
+    delallocLimit = saved_limit;
+    reservationWindow = saved_window;
 }
 
-int main()
+// the global file system wrapped up for the scaling benchmark
+struct ExtendedFileSystem
+{
+    ExtendedFileSystem(DiskGeometry g) { formatDisk(g); }
+    bool createOrModifyFile(string name, long long size) { return initAllocate(name, size); }
+    void readFile(string name) { ::readFile(name); }
+    long long pread(string name, long long offset, char *buffer, long long length) { return preadFile(name, offset, buffer, length); }
+    void deleteFile(string name) { ::deleteFile(name); }
+    vector<bool> createBatch(const vector<CreateRequest> &requests) { return ::createBatch(requests); }
+    vector<bool> deleteBatch(const vector<string> &names) { return ::deleteBatch(names); }
+    size_t metadataBytes() { return ::metadataBytes(); }
+    const OpMetrics &opMetrics() { return op_metrics; }
+};
+
+int main(int argc, char *argv[])
 {
+    if (hasFlag(argc, argv, "--bench"))
+    {
+        log_ops = false;
+        DiskGeometry largest = parseGeometry(argc, argv, {4096, 1 << 28});
+        runScalingBenchmark<ExtendedFileSystem>("contiguous extended", largest);
+        runBatchBenchmark<ExtendedFileSystem>("contiguous extended", {largest.block_size, 1 << 20}, 10000);
+        runFreeSpaceBenchmark();
+        runAppendBenchmark();
+        // before any benchmark opens the image, the random reads copy nothing, like the other layouts
+        runRandomReadBenchmark<ExtendedFileSystem>("contiguous extended", {largest.block_size, 1 << 20});
+        runExtentReadBenchmark(flagString(argc, argv, "--image", "contiguous_extended.img"));
+        return 0;
+    }
+
     freopen("log.txt", "a", stdout);
+    formatDisk(parseGeometry(argc, argv, DEFAULT_GEOMETRY));
+    reservationWindow = hasFlag(argc, argv, "--no-window") ? 0 : (int)flagValue(argc, argv, "--window", reservationWindow);
+    device.open(flagString(argc, argv, "--image", "contiguous_extended.img"), geometry);
 
     initAllocate("file1.txt", 8192);
     initAllocate("file2.txt", 16384);
@@ -199,18 +768,51 @@ int main()
     initAllocate("file4.txt", 24576);
     readFile("file1.txt");
     readFile("file3.txt");
+
+    // data written across the initial run and an extension reads back in order
+    extendAllocate("file3.txt", 4096);
+    string text(4096, '.');
+    text += "this sentence starts in the extension";
+    if (writeFile("file3.txt", text))
+    {
+        char buffer[8192];
+        long long bytes = readFileData("file3.txt", buffer, text.size());
+        cout << "read back " << bytes << " bytes of file3.txt: ..." << string(buffer + 4096, bytes - 4096) << "\n";
+        bytes = preadFile("file3.txt", 4096 + 5, buffer, 8);
+        cout << "read " << bytes << " bytes at offset 4101 of file3.txt: " << string(buffer, bytes) << "\n";
+    }
+
+    // appends to two logs in turn: reservation windows or delayed allocation
+    // keep each log together instead of alternating blocks
+    delayed_allocation = hasFlag(argc, argv, "--delalloc");
+    delallocLimit = flagValue(argc, argv, "--delalloc-limit", delallocLimit);
+    initAllocate("app.log", 4096);
+    initAllocate("db.log", 4096);
+    for (int i = 0; i < 4; i++)
+    {
+        extendAllocate("app.log", 4096);
+        extendAllocate("db.log", 4096);
+    }
+    closeFile("app.log");
+    closeFile("db.log");
+    cout << "app.log is in " << directory.find("app.log")->extents.size() << " extents\n";
+    readFile("app.log");
+
+    // several files with one call each
+    createBatch({{"batch1.txt", 4096}, {"batch2.txt", 8192}, {"file1.txt", 4096}});
+    readFile("batch2.txt");
+    deleteBatch({"batch1.txt", "batch2.txt"});
+
+    cout << "\nOperation latencies:\n";
+    op_metrics.dump(cout);
+
     long max_rss = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
 
     // Convert to megabytes
     double max_rss_mb = max_rss / (1024.0 * 1024.0);
 
     cout << "Memory used by program: " << max_rss_mb << " MB" << endl;
-    int totalBlocks = 0;
-    for (int i = 0; i < NUM_BLOCKS; i++)
-    {
-        if (blocks[i])
-            totalBlocks++;
-    }
+    int totalBlocks = geometry.num_blocks - blocks.countFree();
     cout << "Total blocks used : " << totalBlocks << endl;
 
     cout << "\n-----------end of contiguous extended---------------------\n";
@@ -7,163 +7,335 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <set>
+#include "batch.h"
+#include "bitmap.h"
+#include "block_device.h"
+#include "directory_index.h"
+#include "disk_geometry.h"
+#include "free_extent_index.h"
+#include "latency_histogram.h"
+#include "scaling_benchmark.h"
 using namespace std;
 using namespace std::chrono; // for time stamps
 
-const int BLOCK_SIZE = 4096; // block size in bytes
-const int NUM_BLOCKS = 512;  // total number of blocks on the disk
+const DiskGeometry DEFAULT_GEOMETRY = {4096, 512}; // 4 KB blocks, 512 blocks on the disk
+
+const int DEFRAG_IDLE_MS = 100; // pause of the defrag thread after a pass that moved nothing
 
 int total_block_count = 0;
+bool log_ops = true; // print a line per operation, turned off for benchmarks
 
 struct File
 {
     string name;
     int start_block;
     int num_blocks;
+    long long size; // bytes
+};
+
+// how modifications of existing files were carried out
+struct ResizeMetrics
+{
+    long long in_place_grows = 0;   // grew into the free blocks right after the file
+    long long in_place_shrinks = 0; // freed the tail of the run (also same size rewrites)
+    long long relocations = 0;      // had to move to a new run
+    long long relocated_blocks = 0; // blocks copied by relocations
+};
+
+// shape of the free space, see FileSystem::fragmentation
+struct FragmentationMetrics
+{
+    int largest_free_run = 0;
+    int free_extents = 0;
+    long long free_blocks = 0;
+    vector<int> run_histogram; // run_histogram[k] counts free runs of 2^k to 2^(k+1)-1 blocks
+};
+
+// work done by the compaction engine
+struct DefragMetrics
+{
+    long long passes = 0;
+    long long files_moved = 0;
+    long long blocks_moved = 0;
 };
 
+// All public operations are safe to call from several threads: reads share
+// the lock, everything that changes metadata takes it exclusively. The online
+// defragmenter runs on its own thread and takes the lock once per moved file.
 class FileSystem
 {
 private:
-    vector<bool> blocks;    // tracks which blocks are free or allocated
-    vector<File> directory; // directory of files on the disk
+    DiskGeometry geometry;
+    Bitmap blocks;                  // tracks which blocks are free or allocated
+    DirectoryIndex<File> directory; // directory of files on the disk, hashed by name
+    FreeExtentIndex free_extents;   // free runs of blocks, used to place new files
+    FitPolicy fit_policy;
+    BlockDevice *device = nullptr;  // backing image for file data, optional
+    ResizeMetrics resize_metrics;
+    OpMetrics op_metrics;           // counters and latency histograms, lock-free
+    DefragMetrics defrag_metrics;
+    mutable shared_mutex lock;      // shared for reads, exclusive for changes
+
+    thread defrag_thread;
+    mutex defrag_mutex;             // pairs with defrag_wake to sleep off the I/O budget
+    condition_variable defrag_wake;
+    atomic<bool> defrag_stop{false};
 
 public:
-    FileSystem()
+    FileSystem(DiskGeometry geometry = DEFAULT_GEOMETRY, FitPolicy policy = FitPolicy::FIRST_FIT)
+        : geometry(geometry), fit_policy(policy)
     {
         // initialize all blocks as free
-        blocks.resize(NUM_BLOCKS, false);
+        blocks.resize(geometry.num_blocks);
+        free_extents.insert(0, geometry.num_blocks);
     }
 
-    bool createOrModifyFile(string name, int size)
+    ~FileSystem()
     {
-        auto start = high_resolution_clock::now();                    // start time stamp
-        int num_blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE; // round up to nearest block
-        int start_block = -1;
+        stopDefrag();
+    }
 
-        // check if file already exists in the directory
-        for (int i = 0; i < directory.size(); i++)
+    void setFitPolicy(FitPolicy policy)
+    {
+        unique_lock<shared_mutex> guard(lock);
+        fit_policy = policy;
+    }
+
+    // store file data in device, which must have the same geometry
+    void attachDevice(BlockDevice *backing)
+    {
+        unique_lock<shared_mutex> guard(lock);
+        device = backing;
+    }
+
+    bool createOrModifyFile(string name, long long size)
+    {
+        OpTimer timer(op_metrics, Op::CREATE);
+        unique_lock<shared_mutex> guard(lock);
+        if (!createOrModifyLocked(name, size))
+            return false;
+        timer.succeeded();
+        return true;
+    }
+
+    bool deleteFile(string name)
+    {
+        OpTimer timer(op_metrics, Op::DELETE);
+        unique_lock<shared_mutex> guard(lock);
+        File *file = directory.find(name);
+        if (file)
         {
-            if (directory[i].name == name)
-            {
-                // free the old blocks allocated to the file
-                int old_start_block = directory[i].start_block;
-                int old_num_blocks = directory[i].num_blocks;
-                for (int j = old_start_block; j < old_start_block + old_num_blocks; j++)
-                {
-                    blocks[j] = false;
-                }
-                directory.erase(directory.begin() + i);
-                break;
-            }
+            int num_blocks = file->num_blocks;
+            freeBlocks(file->start_block, num_blocks); // free the blocks allocated to the file
+            directory.erase(name);                     // remove the file from the directory
+            decrementBlockCount(num_blocks);
+            if (log_ops)
+                cout << "Deleted " << name << "\n";
+            timer.succeeded();
+            return true;
         }
+        if (log_ops)
+            cout << "Failed to delete " << name << "\n";
+        return false; // file not found in the directory
+    }
 
-        // search for a contiguous block of free blocks
-        for (int i = 0; i < NUM_BLOCKS; i++)
+    // Create many new files at once. Requests are packed into the free runs in
+    // one pass in address order, each run taking the largest waiting files that
+    // still fit, so no request searches the free space on its own. Names that
+    // exist already go through the usual modify path, a name given twice in
+    // one batch only counts the first time. Returns one result per request.
+    vector<bool> createBatch(const vector<CreateRequest> &requests)
+    {
+        OpTimer timer(op_metrics, Op::CREATE_BATCH);
+        unique_lock<shared_mutex> guard(lock);
+        vector<bool> results(requests.size(), false);
+        set<pair<long long, int>> waiting; // (blocks, request), the largest fitting one is picked per run
+        for (int i : uniqueSizeOrder(requests, true))
         {
-            if (!blocks[i])
-            {
-                int j = i + 1;
-                while (j < NUM_BLOCKS && !blocks[j])
-                {
-                    j++;
-                }
-
-                if (j - i >= num_blocks_needed)
-                {
-                    start_block = i;
-                    break;
-                }
-
-                i = j; // skip to the end of the contiguous free blocks
-            }
+            const CreateRequest &request = requests[i];
+            if (directory.find(request.name))
+                results[i] = createOrModifyLocked(request.name, request.size);
+            else
+                waiting.insert({geometry.blocksFor(request.size), i});
         }
 
-        // if a contiguous block of free blocks was found, allocate them to the file
-        if (start_block >= 0)
+        directory.reserve(directory.size() + waiting.size());
+        long long placed_blocks = 0;
+        for (int run = free_extents.nextRunStart(0); run != -1 && !waiting.empty(); )
         {
-            for (int i = start_block; i < start_block + num_blocks_needed; i++)
+            int run_length = free_extents.runAt(run);
+            int next_run = free_extents.nextRunStart(run + run_length);
+            int used_blocks = 0;
+            while (!waiting.empty())
             {
-                blocks[i] = true;
+                auto fit = waiting.upper_bound({run_length - used_blocks, INT_MAX});
+                if (fit == waiting.begin())
+                    break;
+                --fit;
+                const CreateRequest &request = requests[fit->second];
+                directory.insert({request.name, run + used_blocks, (int)fit->first, request.size});
+                results[fit->second] = true;
+                used_blocks += (int)fit->first;
+                waiting.erase(fit);
             }
-            directory.push_back({name, start_block, num_blocks_needed});
-            incrementBlockCount(num_blocks_needed);
-            auto stop = high_resolution_clock::now();                 // stop time stamp
-            auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-            cout << "Created or modified " << name << " in " << duration.count() << " nanoseconds" << endl;
-            return true;
-        }
-        else
-        {
-            auto stop = high_resolution_clock::now();                 // stop time stamp
-            auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-            cout << "Failed to create or modify " << name << " in " << duration.count() << " nanoseconds" << endl;
-            return false; // not enough contiguous free blocks available
+            if (used_blocks > 0)
+            {
+                free_extents.remove(run, used_blocks);
+                blocks.setRange(run, used_blocks);
+                placed_blocks += used_blocks;
+            }
+            run = next_run;
         }
+        incrementBlockCount(placed_blocks);
+
+        if (log_ops)
+            cout << "Created a batch of " << requests.size() << " files (" << count(results.begin(), results.end(), true)
+                 << " succeeded)\n";
+        timer.succeeded();
+        return results;
     }
 
-    bool deleteFile(string name)
+    // Delete many files at once. The freed runs are sorted and neighbours
+    // merged before they go back to the free extent index.
+    vector<bool> deleteBatch(const vector<string> &names)
     {
-        auto start = high_resolution_clock::now(); // start time stamp
-        for (int i = 0; i < directory.size(); i++)
+        OpTimer timer(op_metrics, Op::DELETE_BATCH);
+        unique_lock<shared_mutex> guard(lock);
+        vector<bool> results(names.size(), false);
+        vector<pair<int, int>> freed; // (start, blocks)
+        for (size_t i = 0; i < names.size(); i++)
         {
-            if (directory[i].name == name)
-            {
-                int start_block = directory[i].start_block;
-                int num_blocks = directory[i].num_blocks;
-                for (int j = start_block; j < start_block + num_blocks; j++)
-                {
-                    blocks[j] = false; // free the blocks allocated to the file
-                }
-                directory.erase(directory.begin() + i); // remove the file from the directory
-                decrementBlockCount(num_blocks);
-                auto stop = high_resolution_clock::now();                 // stop time stamp
-                auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-                cout << "Deleted " << name << " in " << duration.count() << " nanoseconds" << endl;
-                return true;
-            }
+            File *file = directory.find(names[i]);
+            if (!file)
+                continue;
+            freed.push_back({file->start_block, file->num_blocks});
+            directory.erase(names[i]);
+            results[i] = true;
         }
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Failed to delete " << name << " in " << duration.count() << " nanoseconds" << endl;
-        return false; // file not found in the directory
+
+        sort(freed.begin(), freed.end());
+        long long freed_blocks = 0;
+        for (size_t i = 0; i < freed.size();)
+        {
+            int run = freed[i].first, run_end = run + freed[i].second;
+            for (i++; i < freed.size() && freed[i].first == run_end; i++)
+                run_end += freed[i].second;
+            freeBlocks(run, run_end - run);
+            freed_blocks += run_end - run;
+        }
+        decrementBlockCount(freed_blocks);
+
+        if (log_ops)
+            cout << "Deleted a batch of " << freed.size() << " of " << names.size() << " files\n";
+        timer.succeeded();
+        return results;
     }
 
     bool readFile(string name)
     {
-        auto start = high_resolution_clock::now(); // start time stamp
+        OpTimer timer(op_metrics, Op::READ);
+        shared_lock<shared_mutex> guard(lock);
 
-        for (const auto &file : directory)
+        const File *file = directory.find(name);
+        if (file)
         {
-            if (file.name == name)
+            if (log_ops)
             {
-                cout << "Blocks of file '" << name << "':" << endl;
+                cout << "Blocks of file '" << name << "':\n";
 
                 // Print the blocks of the file
-                for (int i = file.start_block; i < file.start_block + file.num_blocks; ++i)
+                for (int i = file->start_block; i < file->start_block + file->num_blocks; ++i)
                 {
 
                     // Print the block's data
                     cout << i << ",";
                 }
                 cout << "\n";
-                auto stop = high_resolution_clock::now();                 // stop time stamp
-                auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-                cout << "Read " << name << " in " << duration.count() << " nanoseconds" << endl;
-                return true;
+                cout << "Read " << name << "\n";
             }
+            timer.succeeded();
+            return true;
         }
 
-        cout << name << " NOT FOUND!!\n";
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Failed to read " << name << " (not found) in " << duration.count() << " nanoseconds" << endl;
+        if (log_ops)
+        {
+            cout << name << " NOT FOUND!!\n";
+            cout << "Failed to read " << name << " (not found)\n";
+        }
 
         return false; // file not found
     }
 
+    // create or overwrite name with data, the bytes go to the attached device
+    bool writeFile(string name, const string &data)
+    {
+        unique_lock<shared_mutex> guard(lock);
+        if (!device)
+        {
+            if (log_ops)
+                cout << "Failed to write " << name << " (no device attached)" << endl;
+            return false;
+        }
+        if (!createOrModifyLocked(name, data.size()))
+            return false;
+        const File *file = directory.find(name);
+        device->write(file->start_block, 0, data.data(), data.size());
+        return true;
+    }
+
+    // copies up to length bytes of name into buffer, returns the bytes copied or -1
+    long long readFile(string name, char *buffer, long long length)
+    {
+        shared_lock<shared_mutex> guard(lock);
+        const File *file = directory.find(name);
+        if (!file || !device)
+            return -1;
+        long long bytes = min(length, file->size);
+        device->read(file->start_block, 0, buffer, bytes);
+        return bytes;
+    }
+
+    // Copies up to length bytes of name from byte offset on into buffer,
+    // returns the bytes read (0 at or past the end) or -1 if there is no such
+    // file. The file is one run, so the block at any offset is found with one
+    // division. Without a device the bytes are counted but not copied.
+    long long pread(string name, long long offset, char *buffer, long long length)
+    {
+        OpTimer timer(op_metrics, Op::PREAD);
+        shared_lock<shared_mutex> guard(lock);
+        const File *file = directory.find(name);
+        if (!file || offset < 0)
+            return -1;
+        long long bytes = max(0LL, min(length, file->size - offset));
+        if (device && bytes > 0)
+            device->read(file->start_block, offset, buffer, bytes);
+        timer.succeeded();
+        return bytes;
+    }
+
+    // zero-copy view of the whole file, data is null if there is no such file or no device.
+    // The view goes stale once the file is modified, deleted or moved by the defragmenter.
+    BlockView viewFile(string name) const
+    {
+        shared_lock<shared_mutex> guard(lock);
+        const File *file = directory.find(name);
+        if (!file || !device)
+            return {nullptr, 0};
+        BlockView view = device->view(file->start_block, file->num_blocks);
+        view.size = file->size;
+        return view;
+    }
+
     void printDirectory()
     {
+        shared_lock<shared_mutex> guard(lock);
         cout << "Directory:" << endl;
         for (const auto &file : directory)
         {
@@ -171,6 +343,175 @@ public:
         }
     }
 
+    // bytes of in-memory metadata: block map, free extent index and directory
+    size_t metadataBytes() const
+    {
+        shared_lock<shared_mutex> guard(lock);
+        return blocks.memoryBytes() + free_extents.memoryBytes() + directory.memoryBytes();
+    }
+
+    const OpMetrics &opMetrics() const
+    {
+        return op_metrics;
+    }
+
+    ResizeMetrics resizeMetrics() const
+    {
+        shared_lock<shared_mutex> guard(lock);
+        return resize_metrics;
+    }
+
+    DefragMetrics defragMetrics() const
+    {
+        shared_lock<shared_mutex> guard(lock);
+        return defrag_metrics;
+    }
+
+    FragmentationMetrics fragmentation() const
+    {
+        shared_lock<shared_mutex> guard(lock);
+        FragmentationMetrics metrics;
+        metrics.largest_free_run = free_extents.largestExtent();
+        metrics.free_extents = free_extents.extentCount();
+        metrics.free_blocks = free_extents.freeBlocks();
+        free_extents.forEach([&](int, int length)
+                             {
+            size_t size_class = 31 - __builtin_clz(length);
+            if (metrics.run_histogram.size() <= size_class)
+                metrics.run_histogram.resize(size_class + 1);
+            metrics.run_histogram[size_class]++; });
+        return metrics;
+    }
+
+    // Start compacting on a background thread, moving at most blocks_per_second
+    // blocks (0 for no limit). Passes repeat until stopDefrag, with a short
+    // pause after a pass that found nothing to move.
+    void startDefrag(long long blocks_per_second)
+    {
+        stopDefrag();
+        defrag_stop = false;
+        defrag_thread = thread([this, blocks_per_second]
+                               {
+            while (!defrag_stop)
+            {
+                if (defragPass(blocks_per_second) == 0)
+                {
+                    unique_lock<mutex> guard(defrag_mutex);
+                    defrag_wake.wait_for(guard, milliseconds(DEFRAG_IDLE_MS), [this]
+                                         { return defrag_stop.load(); });
+                }
+            } });
+    }
+
+    void stopDefrag()
+    {
+        if (!defrag_thread.joinable())
+            return;
+        {
+            lock_guard<mutex> guard(defrag_mutex);
+            defrag_stop = true;
+        }
+        defrag_wake.notify_all();
+        defrag_thread.join();
+    }
+
+    // One sliding compaction pass. Files are visited in address order and any
+    // file with free space right before it slides down into that space, so the
+    // free runs merge behind it and collect at the end of the disk. The lock is
+    // held for one file at a time, other operations run between the moves.
+    // Returns the blocks moved.
+    long long defragPass(long long blocks_per_second = 0)
+    {
+        vector<pair<int, string>> order;
+        {
+            shared_lock<shared_mutex> guard(lock);
+            for (const auto &file : directory)
+                order.push_back({file.start_block, file.name});
+        }
+        sort(order.begin(), order.end());
+
+        auto start = steady_clock::now();
+        long long moved = 0;
+        for (const auto &entry : order)
+        {
+            if (defrag_stop)
+                break;
+            int file_moved = compactFile(entry.second);
+            moved += file_moved;
+            if (blocks_per_second > 0 && file_moved > 0)
+            {
+                // sleep until the pass is back within its I/O budget
+                auto due = start + duration_cast<steady_clock::duration>(duration<double>((double)moved / blocks_per_second));
+                unique_lock<mutex> guard(defrag_mutex);
+                defrag_wake.wait_until(guard, due, [this]
+                                       { return defrag_stop.load(); });
+            }
+        }
+        unique_lock<shared_mutex> guard(lock);
+        defrag_metrics.passes++;
+        return moved;
+    }
+
+    // shrink a file by freeing the tail of its run, or grow it into the free
+    // run right after it. Costs O(log extents) plus the changed blocks.
+    bool resizeInPlace(File &file, long long num_blocks_needed)
+    {
+        long long delta = num_blocks_needed - file.num_blocks;
+        int end = file.start_block + file.num_blocks;
+        if (delta <= 0)
+        {
+            freeBlocks(end + (int)delta, (int)-delta);
+            decrementBlockCount((int)-delta);
+            file.num_blocks = (int)num_blocks_needed;
+            resize_metrics.in_place_shrinks++;
+            return true;
+        }
+        if (end >= geometry.num_blocks || free_extents.runAt(end) < delta)
+            return false;
+        free_extents.remove(end, (int)delta);
+        blocks.setRange(end, (int)delta);
+        incrementBlockCount((int)delta);
+        file.num_blocks = (int)num_blocks_needed;
+        resize_metrics.in_place_grows++;
+        return true;
+    }
+
+    // carry the first blocks of a relocated file over to its new run, the runs may overlap
+    void moveData(int from_block, int to_block, int num_blocks)
+    {
+        if (!device || from_block == to_block)
+            return;
+        memmove(device->blockData(to_block), device->blockData(from_block), (size_t)num_blocks * geometry.block_size);
+    }
+
+    // move a file down into the free run that ends where it starts, returns the blocks moved
+    int compactFile(const string &name)
+    {
+        unique_lock<shared_mutex> guard(lock);
+        File *file = directory.find(name);
+        if (!file || file->num_blocks == 0)
+            return 0; // deleted or emptied since the pass started
+        int hole = free_extents.runEndingAt(file->start_block);
+        if (hole < 0)
+            return 0;
+        int old_start = file->start_block;
+        freeBlocks(old_start, file->num_blocks);
+        free_extents.remove(hole, file->num_blocks);
+        blocks.setRange(hole, file->num_blocks);
+        moveData(old_start, hole, file->num_blocks);
+        file->start_block = hole;
+        defrag_metrics.files_moved++;
+        defrag_metrics.blocks_moved += file->num_blocks;
+        return file->num_blocks;
+    }
+
+    // return a run of blocks to the bitmap and the free extent index
+    void freeBlocks(int start_block, int num_blocks)
+    {
+        blocks.clearRange(start_block, num_blocks);
+        free_extents.insert(start_block, num_blocks);
+    }
+
     void incrementBlockCount(int count)
     {
         total_block_count = total_block_count + count;
@@ -182,13 +523,190 @@ public:
             return;
         total_block_count = total_block_count - count;
     }
+
+private:
+    // createOrModifyFile for callers that already hold the lock exclusively
+    bool createOrModifyLocked(const string &name, long long size)
+    {
+        long long num_blocks_needed = geometry.blocksFor(size); // round up to nearest block
+        int start_block = -1;
+        const char *action = "Created";
+
+        // check if file already exists in the directory
+        File *old_file = directory.find(name);
+        if (old_file && resizeInPlace(*old_file, num_blocks_needed))
+        {
+            old_file->size = size;
+            start_block = old_file->start_block;
+            action = "Resized in place";
+        }
+        else if (old_file)
+        {
+            // no room around the old run: free it and search again, the new
+            // run may overlap it so the data is moved after the allocation
+            int old_start = old_file->start_block;
+            int old_num_blocks = old_file->num_blocks;
+            freeBlocks(old_start, old_num_blocks);
+            if (num_blocks_needed <= geometry.num_blocks)
+                start_block = free_extents.allocate((int)num_blocks_needed, fit_policy);
+            if (start_block >= 0)
+            {
+                blocks.setRange(start_block, num_blocks_needed);
+                moveData(old_start, start_block, old_num_blocks);
+                old_file->start_block = start_block;
+                old_file->num_blocks = (int)num_blocks_needed;
+                old_file->size = size;
+                incrementBlockCount(num_blocks_needed - old_num_blocks);
+                resize_metrics.relocations++;
+                resize_metrics.relocated_blocks += old_num_blocks;
+                action = "Relocated";
+            }
+            else
+            {
+                // nothing was allocated since the free, so the old run is still a free run
+                free_extents.remove(old_start, old_num_blocks);
+                blocks.setRange(old_start, old_num_blocks);
+            }
+        }
+        else
+        {
+            // pick a contiguous run of free blocks from the free extent index
+            if (num_blocks_needed <= geometry.num_blocks)
+                start_block = free_extents.allocate((int)num_blocks_needed, fit_policy);
+
+            // if a contiguous block of free blocks was found, allocate them to the file
+            if (start_block >= 0)
+            {
+                blocks.setRange(start_block, num_blocks_needed);
+                directory.insert({name, start_block, (int)num_blocks_needed, size});
+                incrementBlockCount(num_blocks_needed);
+            }
+        }
+
+        if (start_block >= 0)
+        {
+            if (log_ops)
+                cout << action << " " << name << "\n";
+            return true;
+        }
+        if (log_ops)
+            cout << "Failed to create or modify " << name << "\n";
+        return false; // not enough contiguous free blocks available, an existing file is left as it was
+    }
 };
 
-int main()
+// Resizes every file of a fragmented disk by one block up or down. With the
+// in-place path the rate should not depend on the disk size.
+void runResizeBenchmark(DiskGeometry largest)
 {
+    const int MAX_FILES = 20000;
+    cout << "\ncontiguous resize benchmark\n";
+    cout << "Blocks\t\t Resize ops/s\t In place\t Relocated\t Relocated blocks\n";
+    cout << "=================================================================================\n";
+    for (long long num_blocks = 1 << 16; num_blocks <= largest.num_blocks; num_blocks *= 16)
+    {
+        DiskGeometry geometry = {largest.block_size, (int)num_blocks};
+        int num_files = (int)min<long long>(MAX_FILES, num_blocks / 64);
+        FileSystem fs(geometry);
+        vector<long long> sizes(num_files);
+        for (int i = 0; i < num_files; i++)
+        {
+            sizes[i] = (long long)(1 + i * 7 % 64) * geometry.block_size;
+            fs.createOrModifyFile("file" + to_string(i), sizes[i]);
+        }
+        for (int i = 0; i < num_files; i += 4)
+            fs.deleteFile("file" + to_string(i)); // leave gaps to grow into
+
+        int ops = 0;
+        auto start = high_resolution_clock::now();
+        for (int i = 1; i < num_files; i++)
+        {
+            if (i % 4 == 0)
+                continue;
+            long long delta = i % 2 ? geometry.block_size : -geometry.block_size;
+            fs.createOrModifyFile("file" + to_string(i), max<long long>(0, sizes[i] + delta));
+            ops++;
+        }
+        double elapsed = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+
+        const ResizeMetrics &metrics = fs.resizeMetrics();
+        cout << num_blocks << (num_blocks < 10000000 ? "\t\t " : "\t ") << (long long)(ops / elapsed)
+             << "\t\t " << metrics.in_place_grows + metrics.in_place_shrinks << "\t\t " << metrics.relocations
+             << "\t\t " << metrics.relocated_blocks << "\n";
+    }
+}
+
+void printFragmentation(const FragmentationMetrics &metrics)
+{
+    cout << "Free blocks: " << metrics.free_blocks << ", free extents: " << metrics.free_extents
+         << ", largest free run: " << metrics.largest_free_run << " blocks" << endl;
+    cout << "Free runs by size:";
+    for (size_t k = 0; k < metrics.run_histogram.size(); k++)
+        if (metrics.run_histogram[k])
+            cout << " " << (1 << k) << "+:" << metrics.run_histogram[k];
+    cout << endl;
+}
+
+// Fragments a disk, then runs one unthrottled compaction pass while another
+// thread keeps reading files, and reports the free space before and after.
+void runDefragBenchmark(DiskGeometry largest)
+{
+    const int MAX_FILES = 20000;
+    cout << "\ncontiguous defrag benchmark\n";
+    cout << "Blocks\t\t Extents before/after	 Largest run before/after	 Blocks moved	 Pass (ms)\t Reads/s during pass\n";
+    cout << "=========================================================================================================================\n";
+    for (long long num_blocks = 1 << 16; num_blocks <= largest.num_blocks; num_blocks *= 16)
+    {
+        DiskGeometry geometry = {largest.block_size, (int)num_blocks};
+        int num_files = (int)min<long long>(MAX_FILES, num_blocks / 64);
+        FileSystem fs(geometry);
+        for (int i = 0; i < num_files; i++)
+            fs.createOrModifyFile("file" + to_string(i), (long long)(1 + i * 7 % 64) * geometry.block_size);
+        for (int i = 0; i < num_files; i += 2)
+            fs.deleteFile("file" + to_string(i));
+        FragmentationMetrics before = fs.fragmentation();
+
+        atomic<bool> done{false};
+        long long reads = 0;
+        thread reader([&]
+                      {
+            for (int i = 1; !done; i = (i + 2) % num_files, reads++)
+                fs.readFile("file" + to_string(i)); });
+        auto start = high_resolution_clock::now();
+        long long moved = fs.defragPass();
+        double elapsed = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        done = true;
+        reader.join();
+
+        FragmentationMetrics after = fs.fragmentation();
+        cout << num_blocks << (num_blocks < 10000000 ? "\t\t " : "\t ")
+             << before.free_extents << " / " << after.free_extents << "\t\t "
+             << before.largest_free_run << " / " << after.largest_free_run << "\t\t\t "
+             << moved << "\t\t " << elapsed * 1000 << "\t\t " << (long long)(reads / elapsed) << "\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (hasFlag(argc, argv, "--bench"))
+    {
+        log_ops = false;
+        DiskGeometry largest = parseGeometry(argc, argv, {4096, 1 << 28});
+        runScalingBenchmark<FileSystem>("contiguous", largest);
+        runResizeBenchmark(largest);
+        runDefragBenchmark(largest);
+        runBatchBenchmark<FileSystem>("contiguous", {largest.block_size, 1 << 20}, 10000);
+        runRandomReadBenchmark<FileSystem>("contiguous", {largest.block_size, 1 << 20});
+        return 0;
+    }
+
     freopen("log.txt", "a", stdout);
 
-    FileSystem fs;
+    DiskGeometry geometry = parseGeometry(argc, argv, DEFAULT_GEOMETRY);
+    FileSystem fs(geometry);
+    BlockDevice device;
+    if (device.open(flagString(argc, argv, "--image", "contiguous.img"), geometry))
+        fs.attachDevice(&device);
 
     // create or modify files
     fs.createOrModifyFile("file1.txt", 8192);
@@ -219,6 +737,58 @@ int main()
     cout << "Reading file6..." << endl;
     fs.readFile("file6.txt");
 
+    // grow into the hole file2 left behind, shrink back, then grow file3, which file4 blocks in, so it moves
+    fs.createOrModifyFile("file1.txt", 12288);
+    fs.createOrModifyFile("file1.txt", 4096);
+    fs.createOrModifyFile("file3.txt", 4096 * 100);
+    const ResizeMetrics &metrics = fs.resizeMetrics();
+    cout << "Resized in place " << metrics.in_place_grows << " times up and " << metrics.in_place_shrinks
+         << " times down, relocated " << metrics.relocations << " times (" << metrics.relocated_blocks << " blocks copied)" << endl;
+
+    // write real bytes to the image and read them back, copied and in place
+    if (fs.writeFile("notes.txt", "contiguous blocks hold real data"))
+    {
+        char buffer[64];
+        long long bytes = fs.readFile("notes.txt", buffer, sizeof(buffer));
+        cout << "Read back " << bytes << " bytes: " << string(buffer, bytes) << endl;
+        BlockView view = fs.viewFile("notes.txt");
+        cout << "Viewed " << view.size << " bytes in place: " << string(view.data, view.size) << endl;
+        bytes = fs.pread("notes.txt", 11, buffer, 6);
+        cout << "Read " << bytes << " bytes at offset 11: " << string(buffer, bytes) << endl;
+    }
+
+    // create and delete a few files with one call each
+    vector<bool> created = fs.createBatch({{"batch1.txt", 4096}, {"batch2.txt", 12288}, {"batch3.txt", 8192}});
+    fs.printDirectory();
+    fs.deleteBatch({"batch1.txt", "batch2.txt", "batch3.txt", "file6.txt"});
+
+    // fragment the disk until a large file no longer fits, then compact it
+    // in the background while reads go on
+    for (int i = 0; fs.createOrModifyFile("frag" + to_string(i), 3 * 4096); i++)
+        ;
+    for (int i = 0; fs.deleteFile("frag" + to_string(i)); i += 2)
+        ;
+    long long big_size = (long long)geometry.num_blocks / 4 * 4096;
+    fs.createOrModifyFile("big.bin", big_size);
+    printFragmentation(fs.fragmentation());
+
+    fs.startDefrag(flagValue(argc, argv, "--defrag-budget", 4096)); // blocks per second
+    log_ops = false;
+    long long reads = 0;
+    auto defrag_start = steady_clock::now();
+    while (fs.fragmentation().free_extents > 1 && steady_clock::now() - defrag_start < seconds(10))
+    {
+        fs.readFile("file1.txt");
+        reads++;
+    }
+    fs.stopDefrag();
+    log_ops = true;
+    DefragMetrics defrag = fs.defragMetrics();
+    cout << "Defragmented in " << duration_cast<milliseconds>(steady_clock::now() - defrag_start).count() << " ms: moved "
+         << defrag.files_moved << " files (" << defrag.blocks_moved << " blocks), served " << reads << " reads meanwhile" << endl;
+    printFragmentation(fs.fragmentation());
+    fs.createOrModifyFile("big.bin", big_size);
+
     // Get the maximum resident set size
     ifstream status("/proc/self/status");
     if (!status)
@@ -238,8 +808,11 @@ int main()
     }
     status.close();
 
+    cout << "\nOperation latencies:\n";
+    fs.opMetrics().dump(cout);
+
     cout << "Total blocks used : " << total_block_count << endl;
-    cout << "Total memory used by blocks : " << total_block_count * BLOCK_SIZE << "bytes\n";
+    cout << "Total memory used by blocks : " << (long long)total_block_count * geometry.block_size << "bytes\n";
 
     cout << "\n-----------end of contiguous ---------------------\n";
 
@@ -0,0 +1,214 @@
+#ifndef DIRECTORY_INDEX_H
+#define DIRECTORY_INDEX_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Directory of files with O(1) average lookup, insert and remove by name.
+//
+// Entries live in a slab (a vector whose freed slots are reused) and are
+// found through an open addressing table of (name hash, slab index) slots with
+// linear probing. The hash of every name is stored in its slot, so probes
+// compare hashes before strings and growing the table never rehashes names.
+// Removing a file leaves a tombstone in the table and a hole in the slab,
+// nothing else moves. Tombstones are dropped the next time the table grows.
+//
+// Key names the member of T that holds the file name. Pointers returned by
+// find stay valid until the next insert.
+template <typename T, std::string T::*Key = &T::name>
+class DirectoryIndex
+{
+public:
+    DirectoryIndex() : live_count(0), used_slots(0)
+    {
+        slots.resize(16, {0, EMPTY});
+    }
+
+    T *find(const std::string &name)
+    {
+        int entry = lookup(name, hashName(name));
+        return entry < 0 ? nullptr : &entries[entry].value;
+    }
+
+    const T *find(const std::string &name) const
+    {
+        int entry = lookup(name, hashName(name));
+        return entry < 0 ? nullptr : &entries[entry].value;
+    }
+
+    // adds a file, the name must not already be in the directory
+    T &insert(const T &value)
+    {
+        if ((used_slots + 1) * 10 > slots.size() * 7)
+            rehash(live_count * 4 >= slots.size() ? slots.size() * 2 : slots.size()); // grow or just drop tombstones
+
+        int entry;
+        if (!free_entries.empty())
+        {
+            entry = free_entries.back();
+            free_entries.pop_back();
+            entries[entry] = {value, true};
+        }
+        else
+        {
+            entry = (int)entries.size();
+            entries.push_back({value, true});
+        }
+
+        uint64_t hash = hashName(value.*Key);
+        size_t i = probeStart(hash);
+        while (slots[i].entry >= 0)
+            i = (i + 1) & (slots.size() - 1);
+        if (slots[i].entry == EMPTY)
+            used_slots++;
+        slots[i] = {hash, entry};
+        live_count++;
+        return entries[entry].value;
+    }
+
+    // removes a file, returns false if the name is not in the directory
+    bool erase(const std::string &name)
+    {
+        uint64_t hash = hashName(name);
+        for (size_t i = probeStart(hash); slots[i].entry != EMPTY; i = (i + 1) & (slots.size() - 1))
+        {
+            int entry = slots[i].entry;
+            if (entry >= 0 && slots[i].hash == hash && entries[entry].value.*Key == name)
+            {
+                slots[i].entry = TOMBSTONE;
+                entries[entry].live = false;
+                entries[entry].value = T();
+                free_entries.push_back(entry);
+                live_count--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // make room for count files in total, so a bulk insert rehashes at most once
+    void reserve(size_t count)
+    {
+        entries.reserve(count);
+        size_t needed = slots.size();
+        while (count * 10 > needed * 7)
+            needed *= 2;
+        if (needed > slots.size())
+            rehash(needed);
+    }
+
+    size_t size() const { return live_count; }
+    bool empty() const { return live_count == 0; }
+
+    void clear()
+    {
+        entries.clear();
+        free_entries.clear();
+        slots.assign(16, {0, EMPTY});
+        live_count = used_slots = 0;
+    }
+
+    // bytes held by the table and the slab, not counting heap owned by the entries
+    size_t memoryBytes() const
+    {
+        return slots.capacity() * sizeof(Slot) + entries.capacity() * sizeof(Entry) +
+               free_entries.capacity() * sizeof(int);
+    }
+
+    // iteration visits the live entries in slab order
+    template <typename EntryVector, typename Ref>
+    class Iterator
+    {
+    public:
+        Iterator(EntryVector *entries, size_t i) : entries(entries), i(i) { skipHoles(); }
+        Ref operator*() const { return (*entries)[i].value; }
+        Iterator &operator++()
+        {
+            i++;
+            skipHoles();
+            return *this;
+        }
+        bool operator!=(const Iterator &other) const { return i != other.i; }
+
+    private:
+        EntryVector *entries;
+        size_t i;
+        void skipHoles()
+        {
+            while (i < entries->size() && !(*entries)[i].live)
+                i++;
+        }
+    };
+
+    struct Entry
+    {
+        T value;
+        bool live;
+    };
+    using iterator = Iterator<std::vector<Entry>, T &>;
+    using const_iterator = Iterator<const std::vector<Entry>, const T &>;
+
+    iterator begin() { return iterator(&entries, 0); }
+    iterator end() { return iterator(&entries, entries.size()); }
+    const_iterator begin() const { return const_iterator(&entries, 0); }
+    const_iterator end() const { return const_iterator(&entries, entries.size()); }
+
+private:
+    static const int EMPTY = -1;
+    static const int TOMBSTONE = -2;
+
+    struct Slot
+    {
+        uint64_t hash;
+        int entry; // slab index, EMPTY or TOMBSTONE
+    };
+
+    std::vector<Slot> slots; // power of two sized
+    std::vector<Entry> entries;
+    std::vector<int> free_entries;
+    size_t live_count;
+    size_t used_slots; // live entries plus tombstones
+
+    static uint64_t hashName(const std::string &name)
+    {
+        return std::hash<std::string>()(name);
+    }
+
+    size_t probeStart(uint64_t hash) const
+    {
+        // fibonacci hashing, the multiply spreads every input bit into the high half
+        return (hash * 0x9E3779B97F4A7C15ULL >> 32) & (slots.size() - 1);
+    }
+
+    int lookup(const std::string &name, uint64_t hash) const
+    {
+        for (size_t i = probeStart(hash); slots[i].entry != EMPTY; i = (i + 1) & (slots.size() - 1))
+        {
+            int entry = slots[i].entry;
+            if (entry >= 0 && slots[i].hash == hash && entries[entry].value.*Key == name)
+                return entry;
+        }
+        return -1;
+    }
+
+    void rehash(size_t new_size)
+    {
+        std::vector<Slot> old_slots;
+        old_slots.swap(slots);
+        slots.assign(new_size, {0, EMPTY});
+        for (const Slot &slot : old_slots)
+        {
+            if (slot.entry < 0)
+                continue;
+            size_t i = probeStart(slot.hash);
+            while (slots[i].entry != EMPTY)
+                i = (i + 1) & (slots.size() - 1);
+            slots[i] = slot;
+        }
+        used_slots = live_count;
+    }
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef DISK_GEOMETRY_H
+#define DISK_GEOMETRY_H
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Size of the simulated disk. Every program starts from its own defaults and
+// takes --blocks=N and --block-size=BYTES on the command line to override them.
+struct DiskGeometry
+{
+    int block_size; // bytes per block
+    int num_blocks; // blocks on the disk
+
+    long long diskBytes() const { return (long long)block_size * num_blocks; }
+
+    // blocks needed to hold size bytes, rounded up
+    long long blocksFor(long long size) const { return (size + block_size - 1) / block_size; }
+};
+
+inline bool hasFlag(int argc, char *argv[], const char *flag)
+{
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], flag) == 0)
+            return true;
+    return false;
+}
+
+// value of a numeric --name=value argument, fallback if it is not given
+inline long long flagValue(int argc, char *argv[], const char *name, long long fallback)
+{
+    size_t len = strlen(name);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], name, len) != 0 || argv[i][len] != '=')
+            continue;
+        long long value = atoll(argv[i] + len + 1);
+        if (value <= 0 || value > INT_MAX)
+        {
+            std::cerr << "Error: bad value for " << name << ": " << argv[i] + len + 1 << std::endl;
+            exit(1);
+        }
+        return value;
+    }
+    return fallback;
+}
+
+// value of a --name=value argument, fallback if it is not given
+inline std::string flagString(int argc, char *argv[], const char *name, const std::string &fallback)
+{
+    size_t len = strlen(name);
+    for (int i = 1; i < argc; i++)
+        if (strncmp(argv[i], name, len) == 0 && argv[i][len] == '=')
+            return argv[i] + len + 1;
+    return fallback;
+}
+
+// reads --blocks= and --block-size= from argv, other arguments are left alone
+inline DiskGeometry parseGeometry(int argc, char *argv[], DiskGeometry geometry)
+{
+    geometry.num_blocks = (int)flagValue(argc, argv, "--blocks", geometry.num_blocks);
+    geometry.block_size = (int)flagValue(argc, argv, "--block-size", geometry.block_size);
+    return geometry;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef EXTENT_READER_H
+#define EXTENT_READER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define EXTENT_READER_IO_URING 1
+#endif
+
+// one contiguous piece of the image to copy into the caller's buffer
+struct ExtentRead
+{
+    long long offset; // byte offset in the image
+    char *buffer;
+    size_t length;
+};
+
+// Reads the extents of a file from an image file descriptor into caller
+// buffers.
+//
+// On Linux the reads of one call are queued on an io_uring as one READV per
+// extent and handed to the kernel with a single io_uring_enter, which also
+// waits for all of them, so a file in many pieces costs one system call
+// instead of one per extent (or per block). The ring is set up on the first
+// read; if the kernel refuses (no io_uring, seccomp, ...) or the headers are
+// missing, the reader falls back to one pread per extent, and so it does
+// for good if the ring stops taking or completing entries. Short reads are
+// finished with pread either way. Not thread safe, use one reader per thread.
+class ExtentReader
+{
+public:
+    static const unsigned QUEUE_DEPTH = 256; // extents in flight per submission
+
+    explicit ExtentReader(bool use_ring = true) : ring_state(use_ring ? UNTRIED : DISABLED) {}
+    ~ExtentReader() { closeRing(); }
+
+    ExtentReader(const ExtentReader &) = delete;
+    ExtentReader &operator=(const ExtentReader &) = delete;
+
+    // true once reads go through the ring
+    bool batched() const { return ring_state == READY; }
+
+    // reads every extent, returns the bytes read (less at end of file) or -1 on an I/O error
+    long long read(int fd, const std::vector<ExtentRead> &reads)
+    {
+#ifdef EXTENT_READER_IO_URING
+        if (ring_state == UNTRIED)
+            ring_state = setupRing() ? READY : DISABLED;
+        if (ring_state == READY)
+            return readRing(fd, reads);
+#endif
+        return readEach(fd, reads);
+    }
+
+    // the synchronous path: one pread per extent
+    static long long readEach(int fd, const std::vector<ExtentRead> &reads)
+    {
+        long long total = 0;
+        for (const ExtentRead &r : reads)
+        {
+            long long got = finish(fd, r, 0);
+            if (got < 0)
+                return -1;
+            total += got;
+        }
+        return total;
+    }
+
+private:
+    enum RingState
+    {
+        UNTRIED,
+        READY,
+        DISABLED
+    };
+    RingState ring_state;
+
+    // pread until r is complete from done bytes on, returns its bytes read or -1
+    static long long finish(int fd, const ExtentRead &r, size_t done)
+    {
+        while (done < r.length)
+        {
+            ssize_t got = pread(fd, r.buffer + done, r.length - done, r.offset + done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                return -1;
+            if (got == 0)
+                break; // end of file
+            done += got;
+        }
+        return done;
+    }
+
+#ifdef EXTENT_READER_IO_URING
+    int ring_fd = -1;
+    void *sq_ring = MAP_FAILED, *cq_ring = MAP_FAILED;
+    size_t sq_ring_bytes = 0, cq_ring_bytes = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_bytes = 0;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    std::vector<iovec> iovecs; // one per queued extent, must live until its completion
+
+    template <typename T>
+    static T *at(void *ring, unsigned offset) { return (T *)((char *)ring + offset); }
+
+    bool setupRing()
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = (int)syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+        if (ring_fd < 0)
+            return false;
+        sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+        sq_ring = mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring
+                              : mmap(nullptr, cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            closeRing();
+            return false;
+        }
+        sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+        sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+        cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+        cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+        cq_mask = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+        iovecs.resize(params.sq_entries);
+        return true;
+    }
+
+    void closeRing()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_bytes);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_bytes);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_bytes);
+        if (ring_fd >= 0)
+            close(ring_fd);
+        sqes = (io_uring_sqe *)MAP_FAILED;
+        sq_ring = cq_ring = MAP_FAILED;
+        ring_fd = -1;
+    }
+
+    // queues up to QUEUE_DEPTH extents at a time and submits and waits for them with one call
+    long long readRing(int fd, const std::vector<ExtentRead> &reads)
+    {
+        long long total = 0;
+        for (size_t first = 0; first < reads.size(); first += iovecs.size())
+        {
+            unsigned count = (unsigned)std::min(reads.size() - first, iovecs.size());
+            unsigned tail = *sq_tail; // only this thread writes the tail
+            for (unsigned i = 0; i < count; i++)
+            {
+                const ExtentRead &r = reads[first + i];
+                unsigned slot = (tail + i) & *sq_mask;
+                iovecs[i] = {r.buffer, r.length};
+                io_uring_sqe &sqe = sqes[slot];
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_READV;
+                sqe.fd = fd;
+                sqe.off = r.offset;
+                sqe.addr = (unsigned long long)&iovecs[i];
+                sqe.len = 1;
+                sqe.user_data = first + i;
+                sq_array[slot] = slot;
+            }
+            __atomic_store_n(sq_tail, tail + count, __ATOMIC_RELEASE);
+
+            // The kernel may take fewer entries than it was offered; then the
+            // rest are handed over without waiting, the loop below waits.
+            bool broken = false;
+            unsigned submitted = 0;
+            while (submitted < count)
+            {
+                unsigned wait = submitted == 0 ? count : 0;
+                int entered = (int)syscall(__NR_io_uring_enter, ring_fd, count - submitted, wait,
+                                           wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if (entered < 0 && errno == EINTR)
+                    continue;
+                if (entered <= 0)
+                {
+                    broken = true;
+                    break;
+                }
+                submitted += entered;
+            }
+
+            // only what was submitted completes
+            bool failed = false;
+            unsigned head = *cq_head;
+            for (unsigned reaped = 0; reaped < submitted;)
+            {
+                if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+                {
+                    // interrupted before everything completed, wait for the rest
+                    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                    if (syscall(__NR_io_uring_enter, ring_fd, 0, submitted - reaped, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                        errno != EINTR)
+                    {
+                        broken = true;
+                        break;
+                    }
+                    continue;
+                }
+                const io_uring_cqe &cqe = cqes[head & *cq_mask];
+                const ExtentRead &r = reads[cqe.user_data];
+                long long got = cqe.res < 0 ? -1 : finish(fd, r, cqe.res);
+                if (got < 0)
+                    failed = true;
+                else
+                    total += got;
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (broken)
+            {
+                // Entries the kernel never took are still queued, so the ring
+                // is out of step with this reader: drop it and read
+                // everything again the synchronous way.
+                closeRing();
+                ring_state = DISABLED;
+                return readEach(fd, reads);
+            }
+            if (failed)
+                return -1;
+        }
+        return total;
+    }
+#endif
+};
+
+#endif
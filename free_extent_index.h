@@ -0,0 +1,314 @@
+#ifndef FREE_EXTENT_INDEX_H
+#define FREE_EXTENT_INDEX_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <set>
+#include <utility>
+#include <vector>
+
+// policy used to pick a free run for a new allocation
+enum class FitPolicy
+{
+    FIRST_FIT, // lowest addressed run that is large enough
+    BEST_FIT,  // smallest run that is large enough
+    NEXT_FIT   // first run large enough at or after the previous allocation
+};
+
+// Index of the free runs (extents) of a disk.
+//
+// Runs are kept in two trees: a treap keyed by start block, where every node
+// also stores the longest run in its subtree, and a set keyed by (length, start).
+// The treap answers first-fit and next-fit queries by descending only into
+// subtrees that hold a large enough run, the set answers best-fit queries with
+// a single lower_bound. Both are O(log n) in the number of free runs, and
+// adjacent runs are merged on free so the index never holds two touching runs.
+class FreeExtentIndex
+{
+public:
+    FreeExtentIndex() : root(-1), next_fit_cursor(0), free_blocks(0) {}
+
+    // mark [start, start + length) free, merging with neighbouring free runs
+    void insert(int start, int length)
+    {
+        if (length <= 0)
+            return;
+        free_blocks += length;
+
+        int prev = floorNode(start - 1);
+        if (prev != -1 && nodes[prev].start + nodes[prev].length == start)
+        {
+            start = nodes[prev].start;
+            length += nodes[prev].length;
+            eraseRun(nodes[prev].start);
+        }
+        int next = ceilingNode(start + length);
+        if (next != -1 && nodes[next].start == start + length)
+        {
+            length += nodes[next].length;
+            eraseRun(nodes[next].start);
+        }
+        insertRun(start, length);
+    }
+
+    // mark [start, start + length) used, the range must lie inside one free run
+    bool remove(int start, int length)
+    {
+        if (length <= 0)
+            return true;
+        int node = floorNode(start);
+        if (node == -1)
+            return false;
+        int run_start = nodes[node].start;
+        int run_end = run_start + nodes[node].length;
+        if (start + length > run_end)
+            return false;
+
+        eraseRun(run_start);
+        if (start > run_start)
+            insertRun(run_start, start - run_start);
+        if (start + length < run_end)
+            insertRun(start + length, run_end - start - length);
+        free_blocks -= length;
+        return true;
+    }
+
+    // start of a free run of at least length blocks chosen by policy, -1 if none
+    int find(int length, FitPolicy policy) const
+    {
+        switch (policy)
+        {
+        case FitPolicy::BEST_FIT:
+        {
+            auto it = by_length.lower_bound({length, INT_MIN});
+            return it == by_length.end() ? -1 : it->second;
+        }
+        case FitPolicy::NEXT_FIT:
+        {
+            int start = firstFit(root, length, next_fit_cursor);
+            return start != -1 ? start : firstFit(root, length, 0);
+        }
+        default:
+            return firstFit(root, length, 0);
+        }
+    }
+
+    // find and remove a run of length blocks, returns its start or -1
+    int allocate(int length, FitPolicy policy)
+    {
+        int start = find(length, policy);
+        if (start == -1)
+            return -1;
+        remove(start, length);
+        next_fit_cursor = start + length;
+        return start;
+    }
+
+    // length of the free run starting exactly at start, 0 if start is not a run start
+    int runAt(int start) const
+    {
+        int node = floorNode(start);
+        if (node == -1 || nodes[node].start != start)
+            return 0;
+        return nodes[node].length;
+    }
+
+    // start of the first free run that starts at or after from, -1 if none
+    int nextRunStart(int from) const
+    {
+        int node = ceilingNode(from);
+        return node == -1 ? -1 : nodes[node].start;
+    }
+
+    // start of the free run ending exactly at end, -1 if block end - 1 is not free
+    int runEndingAt(int end) const
+    {
+        int node = floorNode(end - 1);
+        if (node == -1 || nodes[node].start + nodes[node].length != end)
+            return -1;
+        return nodes[node].start;
+    }
+
+    int extentCount() const { return (int)by_length.size(); }
+    int largestExtent() const { return by_length.empty() ? 0 : by_length.rbegin()->first; }
+    long long freeBlocks() const { return free_blocks; }
+
+    // bytes held by the index, counting the usual red-black node overhead for the set
+    size_t memoryBytes() const
+    {
+        return nodes.capacity() * sizeof(Node) + free_nodes.capacity() * sizeof(int) +
+               by_length.size() * (sizeof(std::pair<int, int>) + 32);
+    }
+
+    // calls fn(start, length) for every free run in address order
+    template <typename Fn>
+    void forEach(Fn fn) const
+    {
+        forEach(root, fn);
+    }
+
+private:
+    struct Node
+    {
+        int start;
+        int length;
+        int max_length; // longest run in this subtree
+        int left;
+        int right;
+        unsigned priority;
+    };
+
+    std::vector<Node> nodes;                 // node pool, indices instead of pointers
+    std::vector<int> free_nodes;             // recycled pool slots
+    std::set<std::pair<int, int>> by_length; // (length, start) of every run
+    int root;
+    int next_fit_cursor;
+    long long free_blocks;
+
+    int maxLength(int node) const { return node == -1 ? 0 : nodes[node].max_length; }
+
+    void update(int node)
+    {
+        Node &n = nodes[node];
+        n.max_length = std::max(n.length, std::max(maxLength(n.left), maxLength(n.right)));
+    }
+
+    int newNode(int start, int length)
+    {
+        int node;
+        if (!free_nodes.empty())
+        {
+            node = free_nodes.back();
+            free_nodes.pop_back();
+        }
+        else
+        {
+            node = (int)nodes.size();
+            nodes.push_back({});
+        }
+        nodes[node] = {start, length, length, -1, -1, (unsigned)rand()};
+        return node;
+    }
+
+    // splits node into runs starting before key (left) and at or after key (right)
+    void split(int node, int key, int &left, int &right)
+    {
+        if (node == -1)
+        {
+            left = right = -1;
+            return;
+        }
+        if (nodes[node].start < key)
+        {
+            split(nodes[node].right, key, nodes[node].right, right);
+            left = node;
+        }
+        else
+        {
+            split(nodes[node].left, key, left, nodes[node].left);
+            right = node;
+        }
+        update(node);
+    }
+
+    int merge(int left, int right)
+    {
+        if (left == -1)
+            return right;
+        if (right == -1)
+            return left;
+        if (nodes[left].priority > nodes[right].priority)
+        {
+            nodes[left].right = merge(nodes[left].right, right);
+            update(left);
+            return left;
+        }
+        nodes[right].left = merge(left, nodes[right].left);
+        update(right);
+        return right;
+    }
+
+    void insertRun(int start, int length)
+    {
+        int left, right;
+        split(root, start, left, right);
+        root = merge(merge(left, newNode(start, length)), right);
+        by_length.insert({length, start});
+    }
+
+    void eraseRun(int start)
+    {
+        int left, middle, right;
+        split(root, start, left, middle);
+        split(middle, start + 1, middle, right);
+        if (middle != -1)
+        {
+            by_length.erase({nodes[middle].length, start});
+            free_nodes.push_back(middle);
+        }
+        root = merge(left, right);
+    }
+
+    // run with the largest start <= block, -1 if none
+    int floorNode(int block) const
+    {
+        int node = root, best = -1;
+        while (node != -1)
+        {
+            if (nodes[node].start <= block)
+            {
+                best = node;
+                node = nodes[node].right;
+            }
+            else
+                node = nodes[node].left;
+        }
+        return best;
+    }
+
+    // run with the smallest start >= block, -1 if none
+    int ceilingNode(int block) const
+    {
+        int node = root, best = -1;
+        while (node != -1)
+        {
+            if (nodes[node].start >= block)
+            {
+                best = node;
+                node = nodes[node].left;
+            }
+            else
+                node = nodes[node].right;
+        }
+        return best;
+    }
+
+    // lowest start >= from of a run with at least length blocks, -1 if none
+    int firstFit(int node, int length, int from) const
+    {
+        if (node == -1 || nodes[node].max_length < length)
+            return -1;
+        const Node &n = nodes[node];
+        if (n.start < from)
+            return firstFit(n.right, length, from);
+        int start = firstFit(n.left, length, from);
+        if (start != -1)
+            return start;
+        if (n.length >= length)
+            return n.start;
+        return firstFit(n.right, length, from);
+    }
+
+    template <typename Fn>
+    void forEach(int node, Fn &fn) const
+    {
+        if (node == -1)
+            return;
+        forEach(nodes[node].left, fn);
+        fn(nodes[node].start, nodes[node].length);
+        forEach(nodes[node].right, fn);
+    }
+};
+
+#endif
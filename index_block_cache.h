@@ -0,0 +1,139 @@
+#ifndef INDEX_BLOCK_CACHE_H
+#define INDEX_BLOCK_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "block_device.h"
+
+// Bounded write-back cache of index blocks, the disk blocks that hold the
+// block numbers of indexed files.
+//
+// An index block is block_size / sizeof(int) block numbers. A block is read
+// from the device on its first use and stays cached until it is the least
+// recently used of more than capacity blocks; dirty blocks are written back
+// then or on flush(). The pointers get() and create() return stay valid
+// until their block is evicted, so while holding one at most capacity - 1
+// other blocks may be touched. Without a device there is nowhere to write
+// back to, every block stays cached.
+class IndexBlockCache
+{
+public:
+    IndexBlockCache(BlockDevice *device, int entries_per_block, size_t capacity)
+        : device(device), entries_per_block(entries_per_block), capacity(std::max<size_t>(capacity, 4)) {}
+
+    int entriesPerBlock() const { return entries_per_block; }
+
+    // entries of index block block, read from the device on a miss
+    int *get(int block)
+    {
+        auto found = where.find(block);
+        if (found != where.end())
+        {
+            hit_count++;
+            lru.splice(lru.begin(), lru, found->second);
+            return found->second->entries.data();
+        }
+        miss_count++;
+        Entry &entry = load(block);
+        if (device)
+            device->read(block, 0, (char *)entry.entries.data(), entries_per_block * sizeof(int));
+        return entry.entries.data();
+    }
+
+    // a new index block with every entry -1, written to the device later
+    int *create(int block)
+    {
+        Entry &entry = load(block);
+        std::fill(entry.entries.begin(), entry.entries.end(), -1);
+        entry.dirty = true;
+        return entry.entries.data();
+    }
+
+    // sets one entry of a cached or on-disk index block
+    void set(int block, int i, int value)
+    {
+        get(block)[i] = value;
+        lru.front().dirty = true;
+    }
+
+    // forget block without writing it back, it has been freed
+    void drop(int block)
+    {
+        auto found = where.find(block);
+        if (found == where.end())
+            return;
+        lru.erase(found->second);
+        where.erase(found);
+    }
+
+    // write every dirty block back to the device
+    void flush()
+    {
+        for (Entry &entry : lru)
+            writeBack(entry);
+    }
+
+    void clear()
+    {
+        lru.clear();
+        where.clear();
+    }
+
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+    uint64_t writebacks() const { return writeback_count; }
+    size_t size() const { return lru.size(); }
+    size_t memoryBytes() const
+    {
+        return lru.size() * (sizeof(Entry) + entries_per_block * sizeof(int) + 2 * sizeof(void *)) +
+               where.bucket_count() * sizeof(void *) + where.size() * 32;
+    }
+
+private:
+    struct Entry
+    {
+        int block;
+        bool dirty;
+        std::vector<int> entries;
+    };
+
+    BlockDevice *device;
+    int entries_per_block;
+    size_t capacity;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<int, std::list<Entry>::iterator> where;
+    uint64_t hit_count = 0, miss_count = 0, writeback_count = 0;
+
+    void writeBack(Entry &entry)
+    {
+        if (!entry.dirty || !device)
+            return;
+        device->write(entry.block, 0, (const char *)entry.entries.data(), entries_per_block * sizeof(int));
+        entry.dirty = false;
+        writeback_count++;
+    }
+
+    // a cache entry for block at the front of the list, reusing the buffer of the evicted one
+    Entry &load(int block)
+    {
+        if (device && lru.size() >= capacity)
+        {
+            Entry &victim = lru.back();
+            writeBack(victim);
+            where.erase(victim.block);
+            lru.splice(lru.begin(), lru, std::prev(lru.end()));
+        }
+        else
+            lru.push_front({0, false, std::vector<int>(entries_per_block)});
+        Entry &entry = lru.front();
+        entry.block = block;
+        entry.dirty = false;
+        where[block] = lru.begin();
+        return entry;
+    }
+};
+
+#endif
@@ -6,184 +6,591 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "atomic_bitmap.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "block_device.h"
+#include "directory_index.h"
+#include "disk_geometry.h"
+#include "index_block_cache.h"
+#include "latency_histogram.h"
+#include "per_cpu_counter.h"
+#include "scaling_benchmark.h"
+#include "seek_distance.h"
+#include "sharded_directory.h"
 using namespace std;
 using namespace std::chrono;
 
-const int DISK_SIZE = 1024 * 1024; // 1 MB
-const int BLOCK_SIZE = 4096;       // 4 KB
-const int NUM_BLOCKS = DISK_SIZE / BLOCK_SIZE;
+const DiskGeometry DEFAULT_GEOMETRY = {4096, 256}; // 4 KB blocks, 1 MB disk
 
 int total_block_count = 0;
+bool log_ops = true; // print a line per operation, turned off for benchmarks
 
+const int NUM_DIRECT = 12;              // block numbers kept in the inode itself
+const int INLINE_RUNS = NUM_DIRECT / 2; // runs that fit in the same space
+
+// consecutive blocks start .. start + length - 1
+struct BlockRun
+{
+    int start;
+    int length;
+};
+
+// A file is an inode. While its blocks form at most INLINE_RUNS runs the
+// block map is just those runs, kept in the inode, so a contiguous file of
+// any size costs a few bytes. A file in more pieces is indexed instead: the
+// first NUM_DIRECT data blocks are listed in the inode, the next
+// block_size / 4 in its single-indirect index block, and the rest two
+// levels down from its double-indirect index block. Index blocks live on
+// the device, so the in-memory size of a file does not grow with it.
 struct File
 {
     string name;
-    int start_block;
-    int file_size;
-    vector<int> blocks;
+    int start_block = -1;
+    long long file_size = 0;
+    long long num_blocks = 0; // data blocks
+    bool indexed = false;     // block map is direct + index blocks instead of the inline runs
+    int num_runs = 0;
+    union
+    {
+        BlockRun runs[INLINE_RUNS];
+        int direct[NUM_DIRECT];
+    };
+    int single_indirect = -1; // index block, -1 if not allocated
+    int double_indirect = -1;
+
+    File() : runs{} {}
+    File(const string &name, long long file_size) : name(name), file_size(file_size), runs{} {}
 };
 
-vector<File> directory;
-bool blocks[NUM_BLOCKS];
+// Read-only piece of a block map, handed out without copying: a run of
+// consecutive blocks from the inode, or a slice of block numbers straight
+// out of the inode's direct list or a cached index block.
+struct BlockMapView
+{
+    const int *blocks; // slice of block numbers, null for a run
+    int first;         // first block of a run
+    int length;        // blocks in the view
+
+    int operator[](int i) const { return blocks ? blocks[i] : first + i; }
+    int size() const { return length; }
+};
+
+DirectoryIndex<File> directory; // hashed by file name
+Bitmap blocks; // set bit = allocated block, data and index blocks alike
 
 class FileSystem
 {
+private:
+    DiskGeometry geometry;
+    OpMetrics op_metrics; // counters and latency histograms, lock-free
+    BlockDevice *device = nullptr; // holds the index blocks and file data, optional
+    size_t index_cache_blocks;
+    IndexBlockCache index_cache;
+    int per_block;    // block numbers per index block
+    int group_blocks; // blocks per allocation group, as many as one bitmap block covers
+    bool goal_allocation = true; // keep a file that fits a group in one run there instead of first fit
+    int next_goal = 0;           // block after the last file placed, where a new file starts looking
+
 public:
-    FileSystem()
+    FileSystem(DiskGeometry geometry = DEFAULT_GEOMETRY, size_t index_cache_blocks = 64)
+        : geometry(geometry), index_cache_blocks(index_cache_blocks),
+          index_cache(nullptr, geometry.block_size / sizeof(int), index_cache_blocks),
+          per_block(geometry.block_size / sizeof(int)), group_blocks(geometry.block_size * 8)
     {
-        for (int i = 0; i < NUM_BLOCKS; i++)
-        {
-            blocks[i] = false;
-        }
+        blocks = Bitmap(geometry.num_blocks);
+        directory.clear();
+        total_block_count = 0;
+    }
+
+    ~FileSystem()
+    {
+        index_cache.flush();
     }
 
-    bool createOrModifyFile(string name, int file_size)
+    // Store index blocks and file data in device, which must have the same
+    // geometry and outlive the file system. Attach it before the first file
+    // is created; without a device the index blocks are only kept in memory.
+    void attachDevice(BlockDevice *backing)
     {
-        auto start = high_resolution_clock::now();                  // start time stamp
-        int num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE; // round up division
-        if (num_blocks > NUM_BLOCKS)
+        device = backing;
+        index_cache = IndexBlockCache(backing, per_block, index_cache_blocks);
+    }
+
+    // largest file the inode layout can describe, in blocks
+    long long maxFileBlocks() const
+    {
+        return NUM_DIRECT + per_block + (long long)per_block * per_block;
+    }
+
+    bool createOrModifyFile(string name, long long file_size)
+    {
+        OpTimer timer(op_metrics, Op::CREATE);
+        long long num_blocks = geometry.blocksFor(file_size); // round up division
+        if (num_blocks > geometry.num_blocks || num_blocks > maxFileBlocks())
         {
-            auto stop = high_resolution_clock::now();                 // stop time stamp
-            auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-            cout << "Failed to create/modify " << name << " (file size exceeds disk capacity) in " << duration.count() << " nanoseconds" << endl;
+            if (log_ops)
+                cout << "Failed to create/modify " << name << " (file size exceeds disk capacity)\n";
             return false;
         }
-        for (int i = 0; i < directory.size(); i++)
+        int goal = next_goal; // a rewritten file goes back where it started
+        File *old_file = directory.find(name);
+        if (old_file)
         {
-            if (directory[i].name == name)
-            {
-                vector<int> blocks = directory[i].blocks;
-                for (int j = 0; j < blocks.size(); j++)
-                {
-                    int block = blocks[j];
-                    blocks[block] = false; // free the blocks previously allocated to the file
-                }
-                directory.erase(directory.begin() + i); // remove the file from the directory
-                break;
-            }
+            goal = max(old_file->start_block, 0);
+            decrementBlockCount(freeFile(*old_file)); // free the blocks previously allocated to the file
+            directory.erase(name); // remove the file from the directory
         }
-        vector<int> blocks;
-        int num_blocks_allocated = 0;
-        while (num_blocks_allocated < num_blocks)
+        if (num_blocks + indexBlocksFor(num_blocks) > freeBlockCount())
         {
-            int block = findFreeBlock();
-            if (block == -1)
-            {
-                for (int i = 0; i < blocks.size(); i++)
-                {
-                    int block = blocks[i];
-                    blocks[block] = false; // free the blocks allocated to the file
-                }
-                auto stop = high_resolution_clock::now();                 // stop time stamp
-                auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-                cout << "Failed to create/modify " << name << " (disk space not available) in " << duration.count() << " nanoseconds" << endl;
-                return false;
-            }
-            blocks.push_back(block);
-            // mark block as used by the file
-            num_blocks_allocated++;
-        }
-        directory.push_back({name, blocks[0], file_size, blocks}); // add the file to the directory
-        incrementBlockCount(num_blocks);
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Created/modified " << name << " (file size: " << file_size << " bytes) in " << duration.count() << " nanoseconds" << endl;
+            if (log_ops)
+                cout << "Failed to create/modify " << name << " (disk space not available)\n";
+            return false;
+        }
+        File file(name, file_size);
+        allocateNear(file, num_blocks, goal_allocation ? goal : 0);
+        file.start_block = num_blocks ? blockAt(file, 0) : -1;
+        incrementBlockCount(usedBlocks(file));
+        directory.insert(file); // add the file to the directory
+        if (log_ops)
+            cout << "Created/modified " << name << " (file size: " << file_size << " bytes)\n";
+        timer.succeeded();
         return true;
     }
 
     bool deleteFile(string name)
     {
-        auto start = high_resolution_clock::now(); // start time stamp
-        for (int i = 0; i < directory.size(); i++)
+        OpTimer timer(op_metrics, Op::DELETE);
+        File *file = directory.find(name);
+        if (file)
         {
-            if (directory[i].name == name)
-            {
-                vector<int> blocks = directory[i].blocks;
-                for (int j = 0; j < blocks.size(); j++)
-                {
-                    int block = blocks[j];
-                    blocks[block] = false; // free the blocks allocated to the file
-                }
-                directory.erase(directory.begin() + i); // remove the file from the directory
-                decrementBlockCount(blocks.size());
-                auto stop = high_resolution_clock::now();                 // stop time stamp
-                auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-                cout << "Deleted " << name << " in " << duration.count() << " nanoseconds" << endl;
-                return true;
-            }
+            decrementBlockCount(freeFile(*file)); // free the blocks allocated to the file
+            directory.erase(name); // remove the file from the directory
+            if (log_ops)
+                cout << "Deleted " << name << "\n";
+            timer.succeeded();
+            return true;
         }
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Failed to delete " << name << " (file not found) in " << duration.count() << " nanoseconds" << endl;
+        if (log_ops)
+            cout << "Failed to delete " << name << " (file not found)\n";
         return false;
     }
 
+    // Create many files at once. Files that exist already are modified one by
+    // one first, then the new ones take blocks smallest first, each file
+    // starting where the previous one ended, so no request rescans blocks an
+    // earlier one already passed. Once the disk is full the remaining,
+    // larger, requests fail. A name given twice in one batch only counts the
+    // first time. Returns one result per request.
+    vector<bool> createBatch(const vector<CreateRequest> &requests)
+    {
+        OpTimer timer(op_metrics, Op::CREATE_BATCH);
+        timer.succeeded();
+        vector<bool> results(requests.size(), false);
+        vector<int> waiting;
+        for (int i : uniqueSizeOrder(requests, false))
+        {
+            if (directory.find(requests[i].name))
+                results[i] = createOrModifyFile(requests[i].name, requests[i].size);
+            else
+                waiting.push_back(i);
+        }
+
+        directory.reserve(directory.size() + waiting.size());
+        int cursor = goal_allocation ? next_goal : 0;
+        long long allocated = 0;
+        for (int i : waiting)
+        {
+            long long num_blocks = geometry.blocksFor(requests[i].size);
+            long long needed = num_blocks + indexBlocksFor(num_blocks);
+            if (num_blocks > maxFileBlocks() || needed > freeBlockCount() - allocated)
+                break;
+            File file(requests[i].name, requests[i].size);
+            cursor = allocateNear(file, num_blocks, cursor);
+            file.start_block = num_blocks ? blockAt(file, 0) : -1;
+            allocated += usedBlocks(file);
+            directory.insert(move(file));
+            results[i] = true;
+        }
+        incrementBlockCount(allocated);
+
+        if (log_ops)
+            cout << "Created a batch of " << requests.size() << " files (" << count(results.begin(), results.end(), true)
+                 << " succeeded)\n";
+        return results;
+    }
+
+    vector<bool> deleteBatch(const vector<string> &names)
+    {
+        OpTimer timer(op_metrics, Op::DELETE_BATCH);
+        timer.succeeded();
+        vector<bool> results(names.size(), false);
+        long long freed = 0;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            const File *file = directory.find(names[i]);
+            if (!file)
+                continue;
+            freed += freeFile(*file);
+            directory.erase(names[i]);
+            results[i] = true;
+        }
+        decrementBlockCount(freed);
+
+        if (log_ops)
+            cout << "Deleted a batch of " << count(results.begin(), results.end(), true) << " of " << names.size()
+                 << " files\n";
+        return results;
+    }
+
     void printDirectory()
     {
         cout << "Directory:\n";
-        for (int i = 0; i < directory.size(); i++)
+        for (const auto &file : directory)
         {
-            cout << directory[i].name << " (size: " << directory[i].file_size << " bytes, blocks: ";
-            vector<int> blocks = directory[i].blocks;
-            for (int j = 0; j < blocks.size(); j++)
-            {
-                cout << blocks[j];
-                if (j < blocks.size() - 1)
-                {
-                    cout << ", ";
-                }
-            }
+            cout << file.name << " (size: " << file.file_size << " bytes, blocks: ";
+            printBlocks(file);
             cout << ")\n";
         }
     }
 
     void readFile(string name)
     {
-        auto start = high_resolution_clock::now(); // start time stamp
-        bool found = false;
-        for (int i = 0; i < directory.size(); i++)
+        OpTimer timer(op_metrics, Op::READ);
+        const File *file = directory.find(name);
+        bool found = file != nullptr;
+        if (found)
         {
-            if (directory[i].name == name)
+            timer.succeeded();
+            if (log_ops)
             {
-                found = true;
-                vector<int> blocks = directory[i].blocks;
-                cout << "Reading file " << name << " (size: " << directory[i].file_size << " bytes, blocks: ";
-                for (int j = 0; j < blocks.size(); j++)
-                {
-                    cout << blocks[j];
-                    if (j < blocks.size() - 1)
-                    {
-                        cout << ", ";
-                    }
-                }
-                cout << ")" << endl;
-                break;
+                cout << "Reading file " << name << " (size: " << file->file_size << " bytes, blocks: ";
+                printBlocks(*file);
+                SeekDistance seeks = seekDistance(*file);
+                cout << ", seek distance: " << seeks.distance << " blocks, " << seeks.sequential << " of " << seeks.steps
+                     << " steps sequential)\n";
             }
         }
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
+        if (!log_ops)
+            return;
         if (!found)
         {
-            cout << "Failed to read " << name << " (file not found) in " << duration.count() << " nanoseconds" << endl;
+            cout << "Failed to read " << name << " (file not found)\n";
         }
         else
         {
-            cout << "Read " << name << " in " << duration.count() << " nanoseconds" << endl;
+            cout << "Read " << name << "\n";
+        }
+    }
+
+    // Copies up to length bytes of name from byte offset on into buffer,
+    // returns the bytes read (0 at or past the end) or -1 if there is no such
+    // file. Every block of the read is found with blockAt: a look at the
+    // inline runs, or at most two index blocks, whatever the offset. Without
+    // an image the bytes are counted but not copied.
+    long long pread(string name, long long offset, char *buffer, long long length)
+    {
+        OpTimer timer(op_metrics, Op::PREAD);
+        const File *file = directory.find(name);
+        if (!file || offset < 0)
+            return -1;
+        long long bytes = max(0LL, min(length, file->file_size - offset));
+        for (long long done = 0; done < bytes;)
+        {
+            long long within = (offset + done) % geometry.block_size;
+            long long piece = min(bytes - done, geometry.block_size - within);
+            int block = blockAt(*file, (offset + done) / geometry.block_size);
+            if (device)
+                device->read(block, within, buffer + done, piece);
+            done += piece;
+        }
+        timer.succeeded();
+        return bytes;
+    }
+
+    // data block i of file, looked up in its runs or through its index blocks
+    int blockAt(const File &file, long long i)
+    {
+        if (!file.indexed)
+        {
+            for (int r = 0; r < file.num_runs; i -= file.runs[r++].length)
+                if (i < file.runs[r].length)
+                    return file.runs[r].start + (int)i;
+            return -1;
+        }
+        if (i < NUM_DIRECT)
+            return file.direct[i];
+        i -= NUM_DIRECT;
+        if (i < per_block)
+            return index_cache.get(file.single_indirect)[i];
+        i -= per_block;
+        int single = index_cache.get(file.double_indirect)[i / per_block];
+        return index_cache.get(single)[i % per_block];
+    }
+
+    // calls fn(BlockMapView) for the pieces of the block map of file in
+    // order: one per run of an inline file, one per index block of an
+    // indexed one, each index block loaded once. A view is only valid
+    // during its call and fn must not use the index cache.
+    template <typename Fn>
+    void forEachView(const File &file, Fn fn)
+    {
+        if (!file.indexed)
+        {
+            for (int r = 0; r < file.num_runs; r++)
+                fn(BlockMapView{nullptr, file.runs[r].start, file.runs[r].length});
+            return;
+        }
+        long long left = file.num_blocks;
+        int count = (int)min<long long>(left, NUM_DIRECT);
+        fn(BlockMapView{file.direct, 0, count});
+        left -= count;
+        if (left > 0)
+        {
+            count = (int)min<long long>(left, per_block);
+            fn(BlockMapView{index_cache.get(file.single_indirect), 0, count});
+            left -= count;
+        }
+        for (int s = 0; left > 0; s++)
+        {
+            count = (int)min<long long>(left, per_block);
+            fn(BlockMapView{index_cache.get(index_cache.get(file.double_indirect)[s]), 0, count});
+            left -= count;
         }
     }
 
+    // calls fn(block) for every data block of file in order, fn must not use the index cache
+    template <typename Fn>
+    void forEachBlock(const File &file, Fn fn)
+    {
+        forEachView(file, [&](BlockMapView view)
+                    {
+            for (int i = 0; i < view.size(); i++)
+                fn(view[i]); });
+    }
+
+    // how far the data blocks of file jump around the disk
+    SeekDistance seekDistance(const File &file)
+    {
+        SeekDistance seeks;
+        int prev = -1;
+        forEachView(file, [&](BlockMapView view)
+                    {
+            for (int i = 0; i < view.size(); prev = view[i++])
+                if (prev != -1)
+                    seeks.step(prev, view[i]); });
+        return seeks;
+    }
+
+    // same for the file called name, empty if there is none
+    SeekDistance seekDistance(const string &name)
+    {
+        const File *file = directory.find(name);
+        return file ? seekDistance(*file) : SeekDistance();
+    }
+
+    // off: files are placed first fit from the start of the disk, as before goal allocation
+    void useGoalAllocation(bool on)
+    {
+        goal_allocation = on;
+    }
+
+    const IndexBlockCache &indexCache() const
+    {
+        return index_cache;
+    }
+
+    const OpMetrics &opMetrics() const
+    {
+        return op_metrics;
+    }
+
+    // bytes of in-memory metadata: block map, directory of inodes and the index block cache
+    size_t metadataBytes() const
+    {
+        return blocks.memoryBytes() + directory.memoryBytes() + index_cache.memoryBytes();
+    }
+
 private:
-    int findFreeBlock()
+    // first free block at or after hint, wrapping around, marked used; -1 if the disk is full
+    int findFreeBlock(int hint = 0)
+    {
+        int i = blocks.findFirstFree(hint);
+        if (i == -1 && hint > 0)
+            i = blocks.findFirstFree();
+        if (i != -1)
+            blocks.set(i);
+        return i;
+    }
+
+    int freeBlockCount() const
+    {
+        return geometry.num_blocks - total_block_count;
+    }
+
+    // Claims num_blocks data blocks for file near goal, returns the block
+    // after the last one. A file that fits an allocation group goes into
+    // the first free run after goal in goal's group that holds all of it;
+    // without one, or with goal allocation off, the blocks are claimed in
+    // one pass from goal and may be split over the holes on the way.
+    int allocateNear(File &file, long long num_blocks, int goal)
     {
-        for (int i = 0; i < NUM_BLOCKS; i++)
+        int end = -1;
+        if (goal_allocation && num_blocks > 0 && num_blocks <= group_blocks)
         {
-            if (!blocks[i])
+            int group_end = (int)min<long long>((long long)(goal / group_blocks + 1) * group_blocks, geometry.num_blocks);
+            int start = blocks.findFreeRun((int)num_blocks, goal, group_end);
+            if (start != -1)
             {
-                blocks[i] = true;
-                return i;
+                blocks.setRange(start, (int)num_blocks);
+                appendRun(file, start, (int)num_blocks);
+                end = start + (int)num_blocks;
             }
         }
-        return -1;
+        if (end == -1)
+            end = appendRuns(file, num_blocks, goal);
+        if (num_blocks > 0)
+            next_goal = end;
+        return end;
+    }
+
+    // claims num_blocks data blocks in one pass of the block map from from
+    // and appends them to file, returns the block after the last one. The
+    // caller has checked that they and their index blocks fit.
+    int appendRuns(File &file, long long num_blocks, int from)
+    {
+        int end = from;
+        blocks.allocateRuns(num_blocks, from, [&](int start, int length)
+                            {
+            appendRun(file, start, length);
+            end = start + length; });
+        return end;
+    }
+
+    // add the blocks start .. start + length - 1 to the end of file, as an
+    // inline run while they fit and through the index blocks after that
+    void appendRun(File &file, int start, int length)
+    {
+        if (!file.indexed)
+        {
+            BlockRun *last = file.num_runs ? &file.runs[file.num_runs - 1] : nullptr;
+            if (last && last->start + last->length == start)
+            {
+                last->length += length;
+                file.num_blocks += length;
+                return;
+            }
+            if (file.num_runs < INLINE_RUNS)
+            {
+                file.runs[file.num_runs++] = {start, length};
+                file.num_blocks += length;
+                return;
+            }
+            // out of inline runs: move the blocks so far to the index blocks
+            BlockRun runs[INLINE_RUNS];
+            copy(file.runs, file.runs + INLINE_RUNS, runs);
+            file.indexed = true;
+            file.num_blocks = 0;
+            for (const BlockRun &run : runs)
+                for (int block = run.start; block < run.start + run.length; block++)
+                    appendBlock(file, block);
+        }
+        for (int block = start; block < start + length; block++)
+            appendBlock(file, block);
+    }
+
+    // a new index block near hint, all entries -1
+    int newIndexBlock(int hint)
+    {
+        int block = findFreeBlock(hint);
+        index_cache.create(block);
+        return block;
+    }
+
+    // add block as the next data block of an indexed file, allocating the
+    // index blocks it needs next to it on the way
+    void appendBlock(File &file, int block)
+    {
+        long long i = file.num_blocks;
+        if (i < NUM_DIRECT)
+            file.direct[i] = block;
+        else if ((i -= NUM_DIRECT) < per_block)
+        {
+            if (i == 0)
+                file.single_indirect = newIndexBlock(block);
+            index_cache.set(file.single_indirect, i, block);
+        }
+        else
+        {
+            i -= per_block;
+            if (i == 0)
+                file.double_indirect = newIndexBlock(block);
+            if (i % per_block == 0)
+                index_cache.set(file.double_indirect, i / per_block, newIndexBlock(block));
+            index_cache.set(index_cache.get(file.double_indirect)[i / per_block], i % per_block, block);
+        }
+        file.num_blocks++;
+    }
+
+    // index blocks an indexed file of num_blocks data blocks needs, the most any file of that size can need
+    long long indexBlocksFor(long long num_blocks) const
+    {
+        long long beyond = num_blocks - NUM_DIRECT - per_block; // blocks under the double-indirect block
+        long long singles = beyond > 0 ? (beyond + per_block - 1) / per_block : 0;
+        return (num_blocks > NUM_DIRECT) + (beyond > 0) + singles;
+    }
+
+    // data and index blocks of file
+    long long usedBlocks(const File &file) const
+    {
+        return file.num_blocks + (file.indexed ? indexBlocksFor(file.num_blocks) : 0);
+    }
+
+    // give the data and index blocks of file back, returns how many there were
+    long long freeFile(const File &file)
+    {
+        long long freed = file.num_blocks;
+        forEachView(file, [](BlockMapView view)
+                    {
+            if (!view.blocks)
+                blocks.clearRange(view.first, view.size());
+            else
+                for (int i = 0; i < view.size(); i++)
+                    blocks.clear(view[i]); });
+        if (file.double_indirect != -1)
+        {
+            const int *entries = index_cache.get(file.double_indirect);
+            for (int s = 0; s < per_block && entries[s] != -1; s++)
+            {
+                freeIndexBlock(entries[s]);
+                freed++;
+            }
+        }
+        for (int index : {file.double_indirect, file.single_indirect})
+            if (index != -1)
+            {
+                freeIndexBlock(index);
+                freed++;
+            }
+        return freed;
+    }
+
+    void freeIndexBlock(int block)
+    {
+        blocks.clear(block);
+        index_cache.drop(block);
+    }
+
+    void printBlocks(const File &file)
+    {
+        const char *separator = "";
+        forEachBlock(file, [&](int block)
+                     {
+            cout << separator << block;
+            separator = ", "; });
     }
 
     void incrementBlockCount(int count)
@@ -199,10 +606,289 @@ private:
     }
 };
 
-int main()
+// file of the concurrent allocator, which keeps its block lists in memory
+struct ListedFile
 {
+    string name;
+    int start_block;
+    long long file_size;
+    vector<int> blocks;
+};
+
+// Indexed allocator for many threads at once. Nothing global is touched:
+// blocks are claimed from an AtomicBitmap with compare-and-swap, files live in
+// a ShardedDirectory with a lock per shard, and the used block count is a
+// PerCpuCounter. The ops do not log, a shared cout would serialize them.
+class ConcurrentFileSystem
+{
+private:
+    DiskGeometry geometry;
+    AtomicBitmap blocks;
+    ShardedDirectory<ListedFile> directory;
+    PerCpuCounter used_blocks;
+    OpMetrics op_metrics;
+
+public:
+    ConcurrentFileSystem(DiskGeometry geometry = DEFAULT_GEOMETRY) : geometry(geometry), blocks(geometry.num_blocks) {}
+
+    bool createOrModifyFile(string name, long long file_size)
+    {
+        OpTimer timer(op_metrics, Op::CREATE);
+        long long num_blocks = geometry.blocksFor(file_size);
+        if (num_blocks > geometry.num_blocks)
+            return false;
+        ListedFile file = {name, -1, file_size, {}};
+        file.blocks.reserve(num_blocks);
+        int hint = allocationHint();
+        while ((long long)file.blocks.size() < num_blocks)
+        {
+            int block = blocks.allocate(hint);
+            if (block == -1)
+            {
+                releaseBlocks(file.blocks); // disk full, give back what was claimed
+                return false;
+            }
+            file.blocks.push_back(block);
+            hint = block;
+        }
+        allocationHint() = hint;
+        file.start_block = file.blocks.empty() ? -1 : file.blocks[0];
+        used_blocks.add(num_blocks);
+
+        // the old blocks of a replaced file are freed only after the new entry is visible
+        ListedFile old_file;
+        if (directory.insertOrReplace(file, &old_file))
+        {
+            releaseBlocks(old_file.blocks);
+            used_blocks.add(-(long long)old_file.blocks.size());
+        }
+        timer.succeeded();
+        return true;
+    }
+
+    bool deleteFile(string name)
+    {
+        OpTimer timer(op_metrics, Op::DELETE);
+        ListedFile file;
+        if (!directory.erase(name, &file))
+            return false;
+        releaseBlocks(file.blocks);
+        used_blocks.add(-(long long)file.blocks.size());
+        timer.succeeded();
+        return true;
+    }
+
+    // number of blocks of the file, -1 if there is no such file
+    long long readFile(string name)
+    {
+        OpTimer timer(op_metrics, Op::READ);
+        long long num_blocks = -1;
+        if (directory.read(name, [&](const ListedFile &file)
+                           { num_blocks = file.blocks.size(); }))
+            timer.succeeded();
+        return num_blocks;
+    }
+
+    long long usedBlocks() const { return used_blocks.read(); }
+    const OpMetrics &opMetrics() const { return op_metrics; }
+    int freeBlocks() const { return blocks.countFree(); }
+    size_t fileCount() const { return directory.size(); }
+
+private:
+    void releaseBlocks(const vector<int> &file_blocks)
+    {
+        for (int block : file_blocks)
+            blocks.release(block);
+    }
+
+    // where this thread continues allocating, threads start spread over the disk
+    int &allocationHint()
+    {
+        static atomic<unsigned> next_thread{0};
+        thread_local int hint = (int)((next_thread++ * 0x9E3779B9ULL) % max(geometry.num_blocks, 1));
+        return hint;
+    }
+};
+
+// Runs the same create/read/delete mix on 1, 2, 4 ... max_threads threads,
+// each thread on its own files, and prints the total throughput.
+void runConcurrentBenchmark(DiskGeometry geometry, int max_threads)
+{
+    const int ROUNDS = 20000;   // per thread, 4 ops each
+    const int LIVE_FILES = 32; // per thread
+    cout << "\nindexed concurrent benchmark (" << geometry.num_blocks << " blocks, "
+         << thread::hardware_concurrency() << " hardware threads)\n";
+    cout << "Threads\t Ops/s\t\t Speedup\t Create p99 (ns)\t Read p99 (ns)\t Consistent\n";
+    cout << "=========================================================================================\n";
+    double single_rate = 0;
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    {
+        ConcurrentFileSystem fs(geometry);
+        vector<thread> threads;
+        auto start = high_resolution_clock::now();
+        for (int t = 0; t < num_threads; t++)
+            threads.emplace_back([&fs, &geometry, t]
+                                 {
+                string prefix = "t" + to_string(t) + "_";
+                for (int i = 0; i < ROUNDS; i++)
+                {
+                    string name = prefix + to_string(i % LIVE_FILES);
+                    fs.createOrModifyFile(name, (long long)(1 + i % 16) * geometry.block_size);
+                    fs.readFile(name);
+                    fs.readFile(prefix + to_string((i + 7) % LIVE_FILES));
+                    if (i % 2)
+                        fs.deleteFile(name);
+                } });
+        for (thread &th : threads)
+            th.join();
+        double elapsed = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        long long ops = (long long)num_threads * ROUNDS * 7 / 2;
+        double rate = ops / elapsed;
+        if (num_threads == 1)
+            single_rate = rate;
+
+        // the counter and the block map must agree once every thread is done
+        bool consistent = fs.usedBlocks() == geometry.num_blocks - fs.freeBlocks();
+        cout << num_threads << "\t " << (long long)rate << "\t " << rate / single_rate << "x\t\t "
+             << fs.opMetrics().latency(Op::CREATE).percentile(0.99) << "\t\t "
+             << fs.opMetrics().latency(Op::READ).percentile(0.99) << "\t\t " << (consistent ? "yes" : "NO") << "\n";
+    }
+}
+
+// Creates one file of FILE_BLOCKS blocks on a disk where every stride-th
+// block is already used (none for stride 0), so the file is in runs of
+// stride - 1 blocks, and reports the size of its block map and how fast it
+// can be walked. A block list takes 4 bytes per block whatever the layout;
+// a file in a few runs keeps them in its inode, one in many pieces needs
+// index blocks. Then looks up random blocks of the file in single blocks
+// through index caches of different sizes, writing back to a disk image at
+// image that is removed afterwards.
+void runLargeFileBenchmark(DiskGeometry geometry, const string &image)
+{
+    const long long FILE_BLOCKS = 1 << 18; // 1 GiB of 4 KB blocks
+    const int LOOKUPS = 1000000;
+    long long prefilled = 0;
+    // a fresh file system with every stride-th block used, and the file created on it
+    auto createLarge = [&](FileSystem &fs, int stride)
+    {
+        for (long long b = stride - 1; stride > 0 && b < 2 * FILE_BLOCKS; b += stride)
+            blocks.set((int)b);
+        prefilled = total_block_count = geometry.num_blocks - blocks.countFree();
+        return fs.createOrModifyFile("large", FILE_BLOCKS * geometry.block_size) ? directory.find("large") : nullptr;
+    };
+
+    cout << "\nindexed large file block maps (" << FILE_BLOCKS << " blocks on " << geometry.num_blocks << ")\n";
+    cout << "Layout\t\t Runs\t Index blocks\t Map bytes\t Block list bytes\t Walk (ns/block)\n";
+    cout << "=================================================================================\n";
+    for (int stride : {0, (int)FILE_BLOCKS / 4, 2})
+    {
+        FileSystem fs(geometry);
+        const File *file = createLarge(fs, stride);
+        if (!file)
+            return;
+        long long index_blocks = total_block_count - prefilled - FILE_BLOCKS;
+        long long runs = 0, last = -2;
+        auto start = high_resolution_clock::now();
+        fs.forEachBlock(*file, [&](int block)
+                        {
+            runs += block != last + 1;
+            last = block; });
+        double walk_ns = duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / FILE_BLOCKS;
+        cout << (stride == 0 ? "contiguous\t " : stride == 2 ? "every other\t " : "four runs\t ") << runs << "\t "
+             << index_blocks << "\t\t " << sizeof(File) + index_blocks * geometry.block_size << "\t\t "
+             << FILE_BLOCKS * sizeof(int) << "\t\t\t " << walk_ns << "\n";
+    }
+
+    cout << "\nindexed large file lookups (file in single blocks)\n";
+    cout << "Cache blocks\t Create (ms)\t Lookup (ns)\t Hit rate\t Cache bytes\n";
+    cout << "=================================================================\n";
+    for (size_t cache_blocks : {4, 64, 1024})
+    {
+        // the cache only evicts index blocks it can write back, so these runs keep them in an image
+        BlockDevice device;
+        if (!device.open(image, geometry))
+            return;
+        FileSystem fs(geometry, cache_blocks);
+        fs.attachDevice(&device);
+        auto start = high_resolution_clock::now();
+        const File *file = createLarge(fs, 2);
+        double create_ms = duration_cast<duration<double, milli>>(high_resolution_clock::now() - start).count();
+        if (!file)
+            return;
+
+        mt19937 rng(1);
+        uniform_int_distribution<long long> which(0, FILE_BLOCKS - 1);
+        uint64_t hits = fs.indexCache().hits(), misses = fs.indexCache().misses();
+        start = high_resolution_clock::now();
+        for (int i = 0; i < LOOKUPS; i++)
+            fs.blockAt(*file, which(rng));
+        double lookup_ns = duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / LOOKUPS;
+        hits = fs.indexCache().hits() - hits;
+        misses = fs.indexCache().misses() - misses;
+        cout << cache_blocks << "\t\t " << create_ms << "\t\t " << lookup_ns << "\t\t "
+             << (double)hits / (hits + misses) << "\t\t " << fs.indexCache().memoryBytes() << "\n";
+    }
+    unlink(image.c_str());
+}
+
+// Creates a 1 GiB file on disks of growing size whose first half is full,
+// and compares what a block costs with the one-pass allocator against the
+// old way of one findFirstFree from block 0 per block, word by word. The
+// scan grows with the disk, the one-pass cost per block should stay flat.
+void runMultiBlockBenchmark(int largest)
+{
+    const long long FILE_BLOCKS = 1 << 18; // 1 GiB of 4 KB blocks
+    const int SCANNED = 256;              // blocks taken the old way
+    cout << "\nindexed multi-block allocation (" << FILE_BLOCKS << " block file, first half of the disk full)\n";
+    cout << "Blocks\t\t Scan per block (ns)\t One pass per block (ns)\t File create (ms)\n";
+    cout << "=========================================================================\n";
+    for (long long num_blocks = 1 << 20; num_blocks <= largest; num_blocks *= 16)
+    {
+        FileSystem fs({4096, (int)num_blocks});
+        blocks.setRange(0, (int)(num_blocks / 2));
+        total_block_count += num_blocks / 2;
+
+        Bitmap::use_summary = false;
+        auto start = high_resolution_clock::now();
+        for (int i = 0; i < SCANNED; i++)
+            blocks.set(blocks.findFirstFree());
+        double scan_ns = duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / SCANNED;
+        Bitmap::use_summary = true;
+        blocks.clearRange((int)(num_blocks / 2), SCANNED);
+
+        start = high_resolution_clock::now();
+        bool created = fs.createOrModifyFile("large", FILE_BLOCKS * 4096);
+        double create_ms = duration_cast<duration<double, milli>>(high_resolution_clock::now() - start).count();
+        if (!created)
+            return;
+        cout << num_blocks << (num_blocks < 10000000 ? "\t\t " : "\t ") << scan_ns << "\t\t\t "
+             << create_ms * 1e6 / FILE_BLOCKS << "\t\t\t " << create_ms << "\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (hasFlag(argc, argv, "--bench"))
+    {
+        log_ops = false;
+        runScalingBenchmark<FileSystem>("indexed", parseGeometry(argc, argv, {4096, 1 << 28}));
+        runBatchBenchmark<FileSystem>("indexed", {4096, 1 << 20}, 10000);
+        runConcurrentBenchmark({4096, 1 << 20}, (int)flagValue(argc, argv, "--threads", 64));
+        runLargeFileBenchmark({4096, 1 << 20}, flagString(argc, argv, "--cache-image", "index_cache.img"));
+        runMultiBlockBenchmark(parseGeometry(argc, argv, {4096, 1 << 28}).num_blocks);
+        runLocalityBenchmark<FileSystem>("indexed", {4096, 1 << 20});
+        runRandomReadBenchmark<FileSystem>("indexed", {4096, 1 << 20});
+        return 0;
+    }
+
     freopen("log.txt", "a", stdout);
-    FileSystem fileSystem;
+    DiskGeometry geometry = parseGeometry(argc, argv, DEFAULT_GEOMETRY);
+    BlockDevice device;
+    FileSystem fileSystem(geometry, flagValue(argc, argv, "--index-cache", 64));
+    if (device.open(flagString(argc, argv, "--image", "indexed.img"), geometry))
+        fileSystem.attachDevice(&device);
+    bool goal_allocation = !hasFlag(argc, argv, "--no-goal");
+    fileSystem.useGoalAllocation(goal_allocation);
     fileSystem.createOrModifyFile("file2.txt", 8192);
     fileSystem.createOrModifyFile("file1.txt", 4096);
     fileSystem.createOrModifyFile("file3.txt", 16384);
@@ -216,6 +902,36 @@ int main()
 
     fileSystem.readFile("file4.txt");
 
+    fileSystem.createBatch({{"batch1.txt", 4096}, {"batch2.txt", 12288}, {"file3.txt", 4096}});
+    fileSystem.printDirectory();
+    fileSystem.deleteBatch({"batch1.txt", "batch2.txt"});
+
+    // a file in a few runs keeps them in its inode, one in many pieces moves to index blocks
+    fileSystem.createOrModifyFile("large.txt", 20 * 4096);
+    fileSystem.readFile("large.txt");
+    for (int i = 0; i < 16; i++)
+        fileSystem.createOrModifyFile("piece" + to_string(i), 4096);
+    for (int i = 0; i < 16; i += 2)
+        fileSystem.deleteFile("piece" + to_string(i));
+    // first fit fills the holes the pieces left, goal allocation finds a run that holds all of it
+    fileSystem.useGoalAllocation(false);
+    fileSystem.createOrModifyFile("scattered.txt", 20 * 4096);
+    fileSystem.readFile("scattered.txt");
+    fileSystem.useGoalAllocation(goal_allocation);
+    fileSystem.createOrModifyFile("placed.txt", 20 * 4096);
+    fileSystem.readFile("placed.txt");
+    char buffer[16];
+    cout << "Read " << fileSystem.pread("scattered.txt", 19 * 4096 + 100, buffer, sizeof(buffer))
+         << " bytes at offset " << 19 * 4096 + 100 << " of scattered.txt\n";
+    fileSystem.deleteFile("large.txt");
+    fileSystem.deleteFile("scattered.txt");
+    fileSystem.deleteFile("placed.txt");
+    for (int i = 1; i < 16; i += 2)
+        fileSystem.deleteFile("piece" + to_string(i));
+    const IndexBlockCache &cache = fileSystem.indexCache();
+    cout << "Index block cache: " << cache.hits() << " hits, " << cache.misses() << " misses, " << cache.writebacks()
+         << " write-backs\n";
+
     // Get the maximum resident set size
     ifstream status("/proc/self/status");
     if (!status)
@@ -235,8 +951,11 @@ int main()
     }
     status.close();
 
+    cout << "\nOperation latencies:\n";
+    fileSystem.opMetrics().dump(cout);
+
     cout << "Total blocks used : " << total_block_count << endl;
-    cout << "Total memory used by blocks : " << total_block_count * BLOCK_SIZE << "bytes\n";
+    cout << "Total memory used by blocks : " << (long long)total_block_count * geometry.block_size << "bytes\n";
 
     cout << "\n-----------end of indexed ---------------------\n";
     return 0;
@@ -0,0 +1,187 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+// HDR-style histogram of latencies in nanoseconds, safe to record into from
+// any number of threads without a lock.
+//
+// Values below 2^SUB_BITS get a bucket each. Above that every power of two
+// is split into 2^SUB_BITS equal buckets, so a bucket is never wider than
+// about 3% of the values in it, from nanoseconds up to 2^MAX_EXPONENT ns
+// (about 18 minutes; longer values land in the last bucket). Recording is
+// one clz and a few relaxed atomic adds, percentiles walk the ~1200 buckets.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BITS = 5;
+    static const int MAX_EXPONENT = 40;
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t nanoseconds)
+    {
+        counts[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+        uint64_t seen = max_value.load(std::memory_order_relaxed);
+        while (nanoseconds > seen && !max_value.compare_exchange_weak(seen, nanoseconds, std::memory_order_relaxed))
+            ;
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_value.load(std::memory_order_relaxed); }
+    double mean() const { return count() ? (double)sum.load(std::memory_order_relaxed) / count() : 0; }
+
+    // smallest bucket bound at or below which a fraction q of the values lie, 0 when empty
+    uint64_t percentile(double q) const
+    {
+        uint64_t n = count();
+        if (n == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(q * n);
+        if (rank >= n)
+            rank = n - 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < NUM_BUCKETS; b++)
+        {
+            seen += counts[b].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return std::min(bucketUpper(b), max());
+        }
+        return max(); // records raced with the walk
+    }
+
+    void reset()
+    {
+        for (auto &c : counts)
+            c.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max_value.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int NUM_BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+    std::atomic<uint64_t> counts[NUM_BUCKETS];
+    std::atomic<uint64_t> total, sum, max_value;
+
+    static int bucketOf(uint64_t value)
+    {
+        if (value < (uint64_t)SUB_BUCKETS)
+            return (int)value;
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent > MAX_EXPONENT)
+            return NUM_BUCKETS - 1;
+        int sub = (int)(value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    // largest value that falls into bucket b
+    static uint64_t bucketUpper(int b)
+    {
+        if (b < SUB_BUCKETS)
+            return b;
+        int exponent = b / SUB_BUCKETS - 1 + SUB_BITS;
+        uint64_t width = 1ULL << (exponent - SUB_BITS);
+        return (1ULL << exponent) + (b % SUB_BUCKETS + 1) * width - 1;
+    }
+};
+
+// operations that are counted and timed
+enum class Op
+{
+    CREATE, // create or modify
+    DELETE,
+    READ,
+    EXTEND,
+    CREATE_BATCH,
+    DELETE_BATCH,
+    PREAD, // read at a byte offset
+    COUNT
+};
+
+// Counters and a latency histogram per operation. Everything is atomic, so
+// one instance can be shared by threads and left on all the time.
+class OpMetrics
+{
+public:
+    void record(Op op, uint64_t nanoseconds, bool ok)
+    {
+        Stats &stats = ops[(int)op];
+        stats.latency.record(nanoseconds);
+        if (!ok)
+            stats.failed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const LatencyHistogram &latency(Op op) const { return ops[(int)op].latency; }
+    uint64_t count(Op op) const { return ops[(int)op].latency.count(); }
+    uint64_t failed(Op op) const { return ops[(int)op].failed.load(std::memory_order_relaxed); }
+
+    // one row per operation that ran: counts and p50/p99/p999/max latency
+    void dump(std::ostream &out) const
+    {
+        static const char *names[] = {"create", "delete", "read", "extend", "create batch", "delete batch", "pread"};
+        out << "Operation\t Count\t\t Failed\t\t p50 (ns)\t p99 (ns)\t p999 (ns)\t max (ns)\n";
+        out << "=================================================================================================\n";
+        for (int i = 0; i < (int)Op::COUNT; i++)
+        {
+            const LatencyHistogram &h = ops[i].latency;
+            if (h.count() == 0)
+                continue;
+            out << names[i] << (strlen(names[i]) < 8 ? "\t\t " : "\t ") << h.count() << "\t\t "
+                << ops[i].failed.load(std::memory_order_relaxed) << "\t\t " << h.percentile(0.5) << "\t\t "
+                << h.percentile(0.99) << "\t\t " << h.percentile(0.999) << "\t\t " << h.max() << "\n";
+        }
+    }
+
+    void reset()
+    {
+        for (Stats &stats : ops)
+        {
+            stats.latency.reset();
+            stats.failed.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Stats
+    {
+        LatencyHistogram latency;
+        std::atomic<uint64_t> failed{0};
+    };
+    Stats ops[(int)Op::COUNT];
+};
+
+// Times one operation from construction to destruction and records it as
+// failed unless succeeded() was called, so early returns need no extra code.
+class OpTimer
+{
+public:
+    OpTimer(OpMetrics &metrics, Op op) : metrics(metrics), op(op), ok(false), start(std::chrono::steady_clock::now()) {}
+    ~OpTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        metrics.record(op, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), ok);
+    }
+
+    OpTimer(const OpTimer &) = delete;
+    OpTimer &operator=(const OpTimer &) = delete;
+
+    void succeeded() { ok = true; }
+
+private:
+    OpMetrics &metrics;
+    Op op;
+    bool ok;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
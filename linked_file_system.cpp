@@ -7,136 +7,291 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <memory>
+#include <algorithm>
+#include "allocation_table.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "block_device.h"
+#include "chain_readahead.h"
+#include "directory_index.h"
+#include "disk_geometry.h"
+#include "latency_histogram.h"
+#include "metadata_journal.h"
+#include "scaling_benchmark.h"
+#include "seek_distance.h"
 using namespace std;
 using namespace std::chrono;
 
-const int BLOCK_SIZE = 4096; // block size in bytes
-const int NUM_BLOCKS = 512;  // total number of blocks on the disk
+const DiskGeometry DEFAULT_GEOMETRY = {4096, 512}; // 4 KB blocks, 512 blocks on the disk
+const int SWEEP_STEPS = 64; // spliced free blocks whose used bit is cleared per operation
+
 int free_list_head = -1;
+int free_list_tail = -1; // freed chains are spliced on here
 int free_block_count = 0;
 
 int total_block_count = 0;
-
-struct Block
-{
-    bool used = false;
-    int next_block = -1;
-};
+bool log_ops = true; // print a line per operation, turned off for benchmarks
 
 struct File
 {
     string name;
     int start_block = -1;
-    int file_size = 0;
+    long long file_size = 0;
+    int last_block = -1;      // end of the chain, where a seek through the skip index starts
+    long long num_blocks = 0; // blocks in the chain
 };
 
 class FileSystem
 {
 private:
-    vector<Block> blocks;
-    vector<File> directory;
+    DiskGeometry geometry;
+    // next and previous block of the file (or of the free list) for every
+    // block, so a free block can be taken out of the middle of the free list,
+    // and the skip index of the files
+    AllocationTable table;
+    Bitmap used;        // set bit = block belongs to a file, or is on the free list and not swept yet
+    int sweep_cursor = -1;      // first free list block whose used bit is still set, all after it are too
+    long long stale_blocks = 0; // blocks from sweep_cursor to the free list tail
+    int blocks_touched; // blocks at or above this were never handed out and are not on the free list
+    int group_blocks;   // blocks per allocation group, as many as one bitmap block covers
+    bool goal_allocation = true; // place a file's blocks after each other instead of popping the free list
+    int next_goal = 0;           // block after the last one handed out, where a new file starts looking
+    DirectoryIndex<File> directory; // hashed by file name
+    BlockDevice *device = nullptr;  // backing image for file data, optional
+    bool readahead_on = true;       // stream whole-file reads through a prefetch thread
+    unique_ptr<ChainReadahead> readahead; // started on the first whole-file read from device
+    MetadataJournal *journal = nullptr;   // where metadata changes are logged, optional
+    OpMetrics op_metrics;           // counters and latency histograms, lock-free
 
 public:
-    FileSystem()
+    FileSystem(DiskGeometry geometry = DEFAULT_GEOMETRY, bool skip_index = true)
+        : geometry(geometry), table(geometry.num_blocks, skip_index), used(geometry.num_blocks), blocks_touched(0), group_blocks(geometry.block_size * 8)
     {
-        blocks.resize(NUM_BLOCKS);
-        for (int i = 0; i < blocks.size(); i++)
-        {
-            freeBlock(i);
-        }
+        // every block starts free, handed out in order before the free list is used
+        free_list_head = free_list_tail = -1;
+        free_block_count = geometry.num_blocks;
     }
 
-    bool createOrModifyFile(string name, int size)
+    // store file data in device, which must have the same geometry
+    void attachDevice(BlockDevice *backing)
     {
-        auto start = high_resolution_clock::now(); // start time stamp
-        int num_blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        int first_block = -1;
-
-        // check if there is enough space
-        // int free_blocks = 0;
+        device = backing;
+        readahead.reset();
+    }
 
-        if (num_blocks_needed > free_block_count)
-            first_block = -1;
-        else
-            first_block = free_list_head;
+    // log every metadata change from now on to the open journal j
+    void attachJournal(MetadataJournal *j)
+    {
+        journal = j;
+    }
 
-        if (first_block == -1)
-        {
-            auto stop = high_resolution_clock::now();                 // stop time stamp
-            auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-            cout << "Failed to create/modify " << name << " (not enough space) in " << duration.count() << " nanoseconds" << endl;
+    // replaces the history in the journal with the files as they are now
+    bool checkpointJournal()
+    {
+        if (!journal)
             return false;
+        map<string, JournaledFile> files;
+        for (const File &file : directory)
+        {
+            JournaledFile &saved = files[file.name];
+            saved.size = file.file_size;
+            for (int block = file.start_block; block != -1; block = table.next(block))
+                saved.blocks.push_back(block);
         }
+        return journal->checkpoint(files);
+    }
 
-        // free blocks allocated to existing file with same name
-        for (int i = 0; i < directory.size(); i++)
+    // Rebuilds the files of an empty file system from the journal at path:
+    // every file gets the blocks it had, in order, and the blocks between
+    // them go onto the free list in address order. False if the file system
+    // is not empty, the journal could not be read or its blocks do not fit
+    // this disk.
+    bool recover(const string &path)
+    {
+        map<string, JournaledFile> files;
+        if (directory.size() > 0 || MetadataJournal::replay(path, files) < 0)
+            return false;
+        Bitmap seen(geometry.num_blocks); // nothing is marked until every block checks out
+        int touched = 0;
+        for (const auto &entry : files)
+            for (int block : entry.second.blocks)
+            {
+                if (block < 0 || block >= geometry.num_blocks || seen.test(block))
+                    return false;
+                seen.set(block);
+                touched = max(touched, block + 1);
+            }
+        for (const auto &entry : files)
+            for (int block : entry.second.blocks)
+                used.set(block);
+        blocks_touched = touched;
+        directory.reserve(files.size());
+        long long recovered = 0;
+        for (const auto &entry : files)
         {
-            if (directory[i].name == name)
+            File &file = directory.insert(File{entry.first, -1, entry.second.size});
+            for (int block : entry.second.blocks)
             {
-                int block = directory[i].start_block;
-                while (block != -1)
-                {
-                    int next_block = blocks[block].next_block;
-                    freeBlock(block);
-                    block = next_block;
-                }
-                directory.erase(directory.begin() + i);
-                break;
+                table.append(file.last_block, block, file.num_blocks++);
+                if (file.last_block == -1)
+                    file.start_block = block;
+                file.last_block = block;
             }
+            recovered += file.num_blocks;
         }
+        for (int block = 0; block < blocks_touched; block++)
+            if (!used.test(block))
+            {
+                table.append(free_list_tail, block, 0);
+                if (free_list_tail == -1)
+                    free_list_head = block;
+                free_list_tail = block;
+            }
+        free_block_count = geometry.num_blocks - recovered;
+        next_goal = blocks_touched;
+        incrementBlockCount(recovered);
+        return true;
+    }
 
-        // allocate blocks to new file
-        int block = getFreeBlock();
-        int prev_block = block;
-        directory.push_back(File{name, block, size});
+    // off: whole-file reads walk the chain one block read after the other
+    void useReadahead(bool on)
+    {
+        readahead_on = on;
+    }
 
-        for (int i = 0; i < num_blocks_needed - 1; i++)
+    // A new file is chained off the free list. An existing file keeps its
+    // chain: it grows by chaining blocks after its last one and shrinks by
+    // splicing the blocks past its new end back onto the free list, so a
+    // modification costs the blocks it adds, not the size of the file.
+    bool createOrModifyFile(string name, long long size)
+    {
+        OpTimer timer(op_metrics, Op::CREATE);
+        File *file = directory.find(name);
+        bool done = file ? resize(*file, size) : create(name, size);
+        sweep();
+        if (!done)
         {
-            blocks[block].next_block = -1;
-            blocks[prev_block].next_block = getFreeBlock();
-            prev_block = block;
-            block = blocks[prev_block].next_block;
+            if (log_ops)
+                cout << "Failed to create/modify " << name << " (not enough space)\n";
+            return false;
         }
 
-        incrementBlockCount(num_blocks_needed);
+        if (log_ops)
+            cout << "Created/modified " << name << " (size: " << size << " bytes)\n";
+        timer.succeeded();
+        return true;
+    }
 
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Created/modified " << name << " (size: " << size << " bytes) in " << duration.count() << " nanoseconds" << endl;
+    // grow name by bytes, chaining only the blocks that are added
+    bool appendFile(string name, long long bytes)
+    {
+        OpTimer timer(op_metrics, Op::EXTEND);
+        File *file = directory.find(name);
+        bool done = file && resize(*file, file->file_size + bytes);
+        sweep();
+        if (!done)
+        {
+            if (log_ops)
+                cout << "Failed to append to " << name << (file ? " (not enough space)\n" : " (not found)\n");
+            return false;
+        }
+        if (log_ops)
+            cout << "Appended " << bytes << " bytes to " << name << " (size: " << file->file_size << " bytes)\n";
+        timer.succeeded();
         return true;
     }
 
+    // the whole chain goes back to the free list in one splice
     bool deleteFile(string name)
     {
-        int count_blocks = 0;
-        auto start = high_resolution_clock::now(); // start time stamp
-        for (int i = 0; i < directory.size(); i++)
+        OpTimer timer(op_metrics, Op::DELETE);
+        File *file = directory.find(name);
+        if (file)
         {
-            if (directory[i].name == name)
-            {
-                int block = directory[i].start_block;
-                while (block != -1)
-                {
-                    int next_block = blocks[block].next_block;
-                    freeBlock(block);
-                    block = next_block;
-                    count_blocks++;
-                }
-                directory.erase(directory.begin() + i);
-                int num_blocks = directory[i].file_size;
-                decrementBlockCount(count_blocks);
-                auto stop = high_resolution_clock::now();                 // stop time stamp
-                auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-                cout << "Deleted " << name << " in " << duration.count() << " nanoseconds" << endl;
-                return true;
-            }
+            long long num_blocks = file->num_blocks;
+            journalChange(JournalOp::DELETE, *file, 0, -1);
+            spliceFree(file->start_block, file->last_block, num_blocks);
+            directory.erase(name);
+            decrementBlockCount(num_blocks);
+            sweep();
+            if (log_ops)
+                cout << "Deleted " << name << "\n";
+            timer.succeeded();
+            return true;
         }
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Failed to delete " << name << " (not found) in " << duration.count() << " nanoseconds" << endl;
+        if (log_ops)
+            cout << "Failed to delete " << name << " (not found)\n";
         return false;
     }
 
+    // Create many files at once. Files that exist already are modified one by
+    // one, the new ones are chained smallest first straight off the free list
+    // under a single space check. Once the disk is full the remaining, larger,
+    // requests fail. A name given twice in one batch only counts the first
+    // time. Returns one result per request.
+    vector<bool> createBatch(const vector<CreateRequest> &requests)
+    {
+        OpTimer timer(op_metrics, Op::CREATE_BATCH);
+        timer.succeeded();
+        vector<bool> results(requests.size(), false);
+        vector<int> waiting;
+        for (int i : uniqueSizeOrder(requests, false))
+        {
+            if (directory.find(requests[i].name))
+                results[i] = createOrModifyFile(requests[i].name, requests[i].size);
+            else
+                waiting.push_back(i);
+        }
+
+        directory.reserve(directory.size() + waiting.size());
+        long long allocated = 0;
+        for (int i : waiting)
+        {
+            long long num_blocks = geometry.blocksFor(requests[i].size);
+            if (num_blocks > free_block_count)
+                break;
+            File &file = directory.insert(File{requests[i].name, -1, requests[i].size});
+            allocateChain(file, num_blocks, next_goal);
+            journalChange(JournalOp::CREATE, file, 0, file.start_block);
+            allocated += num_blocks;
+            results[i] = true;
+        }
+        incrementBlockCount(allocated);
+        sweep();
+
+        if (log_ops)
+            cout << "Created a batch of " << requests.size() << " files (" << count(results.begin(), results.end(), true)
+                 << " succeeded)\n";
+        return results;
+    }
+
+    vector<bool> deleteBatch(const vector<string> &names)
+    {
+        OpTimer timer(op_metrics, Op::DELETE_BATCH);
+        timer.succeeded();
+        vector<bool> results(names.size(), false);
+        long long freed = 0;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            const File *file = directory.find(names[i]);
+            if (!file)
+                continue;
+            journalChange(JournalOp::DELETE, *file, 0, -1);
+            spliceFree(file->start_block, file->last_block, file->num_blocks);
+            freed += file->num_blocks;
+            directory.erase(names[i]);
+            results[i] = true;
+        }
+        decrementBlockCount(freed);
+        sweep();
+
+        if (log_ops)
+            cout << "Deleted a batch of " << count(results.begin(), results.end(), true) << " of " << names.size()
+                 << " files\n";
+        return results;
+    }
+
     void printDirectory()
     {
         cout << "Directory:" << endl;
@@ -148,58 +303,335 @@ public:
 
     void readFile(string name)
     {
-        auto start = high_resolution_clock::now(); // start time stamp
-        for (const auto &file : directory)
+        OpTimer timer(op_metrics, Op::READ);
+        const File *file = directory.find(name);
+        if (file)
         {
-            if (file.name == name)
-            {
+            if (log_ops)
                 cout << "\nReading File : " << name << "\n";
-                int block = file.start_block;
-                while (block != -1)
-                {
+            SeekDistance seeks;
+            for (int block = file->start_block; block != -1; block = table.next(block))
+            {
+                if (log_ops)
                     cout << block << " ";
-                    block = blocks[block].next_block;
-                }
-                cout << endl;
-                auto stop = high_resolution_clock::now();                 // stop time stamp
-                auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-                cout << "Read " << name << " (size: " << file.file_size << " bytes) in " << duration.count() << " nanoseconds" << endl;
-                return;
+                if (table.next(block) != -1)
+                    seeks.step(block, table.next(block));
+            }
+            if (log_ops)
+            {
+                cout << "\n";
+                cout << "Read " << name << " (size: " << file->file_size << " bytes, seek distance: " << seeks.distance
+                     << " blocks, " << seeks.sequential << " of " << seeks.steps << " steps sequential)\n";
             }
+            timer.succeeded();
+            return;
         }
-        auto stop = high_resolution_clock::now();                 // stop time stamp
-        auto duration = duration_cast<nanoseconds>(stop - start); // calculate duration in nanoseconds
-        cout << "Failed to read " << name << " (not found) in " << duration.count() << " nanoseconds" << endl;
+        if (log_ops)
+            cout << "Failed to read " << name << " (not found)\n";
     }
 
-private:
-    void freeBlock(int block_num)
+    // Copies up to length bytes of name from byte offset on into buffer,
+    // returns the bytes read (0 at or past the end) or -1 if there is no such
+    // file. The block at offset is found through the skip index in
+    // O(log n) steps, or without it by one next step per block before it.
+    // Without a device the bytes are counted but not copied.
+    long long pread(string name, long long offset, char *buffer, long long length)
     {
-        // Mark the block as unused
-        blocks[block_num].used = false;
-        // Add the block to the front of the free list
-        blocks[block_num].next_block = free_list_head;
-        free_list_head = block_num;
-        free_block_count++;
+        OpTimer timer(op_metrics, Op::PREAD);
+        const File *file = directory.find(name);
+        if (!file || offset < 0)
+            return -1;
+        long long bytes = max(0LL, min(length, file->file_size - offset));
+        int block = bytes > 0 ? blockAt(*file, offset / geometry.block_size) : -1;
+        for (long long done = 0; done < bytes; block = table.next(block))
+        {
+            long long within = (offset + done) % geometry.block_size;
+            long long piece = min(bytes - done, geometry.block_size - within);
+            if (device)
+                device->read(block, within, buffer + done, piece);
+            done += piece;
+        }
+        timer.succeeded();
+        return bytes;
     }
 
-    int getFreeBlock()
+    // Copies up to length bytes from the start of name into buffer with
+    // reads of the device's image file, returns the bytes read or -1 if there
+    // is no such file, no device or a read failed. With readahead on, a
+    // prefetch thread follows the chain ahead and keeps several block reads
+    // in flight; without it every block is read once the one before it is.
+    long long readFileData(string name, char *buffer, long long length)
     {
-        if (free_block_count == -1)
+        OpTimer timer(op_metrics, Op::READ);
+        const File *file = directory.find(name);
+        if (!file || !device)
             return -1;
+        long long bytes = max(0LL, min(length, file->file_size));
+        long long num_blocks = geometry.blocksFor(bytes);
+        long long done = 0;
+        auto copy = [&](const char *data, int)
+        {
+            long long piece = min(bytes - done, (long long)geometry.block_size);
+            memcpy(buffer + done, data, piece);
+            done += piece;
+        };
+        if (readahead_on)
+        {
+            if (!readahead)
+                readahead.reset(new ChainReadahead(table, device->fileDescriptor(), geometry.block_size));
+            if (readahead->stream(file->start_block, num_blocks, copy) < 0)
+                return -1;
+        }
+        else
+        {
+            unique_ptr<char[]> data(new char[geometry.block_size]);
+            int block = file->start_block;
+            for (long long i = 0; i < num_blocks; i++, block = table.next(block))
+            {
+                if (!ChainReadahead::readBlock(device->fileDescriptor(), block, geometry.block_size, data.get()))
+                    return -1;
+                copy(data.get(), block);
+            }
+        }
+        timer.succeeded();
+        return bytes;
+    }
+
+    // the prefetch thread of whole-file reads, null before the first one
+    const ChainReadahead *readaheadStats() const
+    {
+        return readahead.get();
+    }
+
+    // block at position i of file, through the skip index when there is one
+    int blockAt(const File &file, long long i)
+    {
+        return table.seek(file.start_block, file.last_block, file.num_blocks, i);
+    }
+
+    // same for the file called name, -1 if there is none
+    int blockAt(const string &name, long long i)
+    {
+        const File *file = directory.find(name);
+        return file ? blockAt(*file, i) : -1;
+    }
+
+    // how far the chain of name jumps around the disk, empty if there is no such file
+    SeekDistance seekDistance(const string &name) const
+    {
+        SeekDistance seeks;
+        const File *file = directory.find(name);
+        for (int block = file ? file->start_block : -1; block != -1 && table.next(block) != -1; block = table.next(block))
+            seeks.step(block, table.next(block));
+        return seeks;
+    }
+
+    // off: every block comes off the head of the free list, as before goal allocation
+    void useGoalAllocation(bool on)
+    {
+        goal_allocation = on;
+    }
+
+    const OpMetrics &opMetrics() const
+    {
+        return op_metrics;
+    }
+
+    // bytes of in-memory metadata: allocation table entries of the blocks handed out so far, used map and directory
+    size_t metadataBytes() const
+    {
+        return table.memoryBytes(blocks_touched) + used.memoryBytes() + directory.memoryBytes();
+    }
+
+private:
+    // a new file of size bytes chained near next_goal, false if the disk has no room
+    bool create(const string &name, long long size)
+    {
+        long long num_blocks = geometry.blocksFor(size);
+        if (num_blocks > free_block_count)
+            return false;
+        File &file = directory.insert(File{name, -1, size});
+        allocateChain(file, num_blocks, next_goal);
+        journalChange(JournalOp::CREATE, file, 0, file.start_block);
+        incrementBlockCount(num_blocks);
+        return true;
+    }
 
-        int free_block = free_list_head;
+    // Grows file by chaining blocks after its last one (an empty file starts
+    // at next_goal), or shrinks it by finding its new last block through the
+    // skip index and splicing the rest of the chain onto the free list. The
+    // blocks it keeps are not touched. False, with file as it was, if the
+    // disk has no room for the growth.
+    bool resize(File &file, long long size)
+    {
+        long long num_blocks = geometry.blocksFor(size);
+        long long added = num_blocks - file.num_blocks;
+        if (added > free_block_count)
+            return false;
+        int old_last = file.last_block;
+        if (added > 0)
+        {
+            allocateChain(file, added, file.last_block == -1 ? next_goal : file.last_block + 1);
+            incrementBlockCount(added);
+        }
+        else if (added < 0)
+        {
+            int last = num_blocks ? blockAt(file, num_blocks - 1) : -1;
+            spliceFree(last == -1 ? file.start_block : table.next(last), file.last_block, -added);
+            if (last == -1)
+                file.start_block = -1;
+            else
+                table.next(last) = -1;
+            file.last_block = last;
+            file.num_blocks = num_blocks;
+            decrementBlockCount(-added);
+        }
+        file.file_size = size;
+        int first_added = added <= 0 ? -1 : old_last == -1 ? file.start_block : table.next(old_last);
+        journalChange(JournalOp::MODIFY, file, min(file.num_blocks, file.num_blocks - added), first_added);
+        return true;
+    }
 
-        free_list_head = blocks[free_list_head].next_block;
+    // Logs a change of file to the journal, if there is one: file keeps its
+    // first kept blocks and the chain from first (-1 for none) follows them.
+    // The chain is logged as runs of blocks next to each other.
+    void journalChange(JournalOp op, const File &file, long long kept, int first)
+    {
+        if (!journal)
+            return;
+        JournalRecord record{op, file.name, file.file_size, kept, {}};
+        for (int block = first; block != -1; block = table.next(block))
+        {
+            if (!record.runs.empty() && record.runs.back().start + record.runs.back().length == block)
+                record.runs.back().length++;
+            else
+                record.runs.push_back({block, 1});
+        }
+        journal->log(record);
+    }
+
+    // Puts the num_blocks blocks of a chain from first to last on the end of
+    // the free list as they are: the chain's own next and prev links already
+    // link them, so only its ends are relinked. Their used bits stay set
+    // until the sweep reaches them.
+    void spliceFree(int first, int last, long long num_blocks)
+    {
+        if (num_blocks == 0)
+            return;
+        table.prev(first) = free_list_tail;
+        table.next(last) = -1;
+        if (free_list_tail == -1)
+            free_list_head = first;
+        else
+            table.next(free_list_tail) = first;
+        free_list_tail = last;
+        if (stale_blocks == 0)
+            sweep_cursor = first;
+        stale_blocks += num_blocks;
+        free_block_count += num_blocks;
+    }
+
+    // Clears the used bits of up to SWEEP_STEPS spliced blocks, so goal
+    // allocation can find them again. They are the blocks from sweep_cursor
+    // to the end of the free list; blocks are only handed out from its head
+    // or, once swept, its middle, so they stay together.
+    void sweep()
+    {
+        for (int steps = 0; stale_blocks > 0 && steps < SWEEP_STEPS; steps++)
+        {
+            used.clear(sweep_cursor);
+            sweep_cursor = table.next(sweep_cursor);
+            stale_blocks--;
+        }
+    }
+
+    // chains num_blocks free blocks to the end of file, the first at or near
+    // goal, each next one after the one before it where possible
+    void allocateChain(File &file, long long num_blocks, int goal)
+    {
+        for (long long i = 0; i < num_blocks; i++)
+        {
+            int block = getFreeBlock(file.last_block == -1 ? goal : file.last_block + 1);
+            table.append(file.last_block, block, file.num_blocks++);
+            if (file.last_block == -1)
+                file.start_block = block;
+            file.last_block = block;
+        }
+        if (file.last_block != -1)
+            next_goal = file.last_block + 1;
+    }
+
+    // Hands out goal if it is free, else the first free block after it in
+    // its allocation group, else the head of the free list or the next never
+    // used block. A block taken out of the middle of the free list is
+    // unlinked through its prev entry.
+    int getFreeBlock(int goal = -1)
+    {
+        if (free_block_count == 0)
+            return -1;
+
+        int free_block = goal_allocation && goal >= 0 ? freeBlockNear(goal) : -1;
+        if (free_block != -1)
+        {
+            if (free_block == blocks_touched)
+                blocks_touched++;
+            else
+                unlinkFree(free_block);
+        }
+        else if (free_list_head != -1)
+        {
+            // Remove free block from list
+            free_block = free_list_head;
+            free_list_head = table.next(free_list_head);
+            if (free_list_head != -1)
+                table.prev(free_list_head) = -1;
+            else
+                free_list_tail = -1;
+            if (free_block == sweep_cursor)
+            {
+                // every free block is still unswept, this one is used again anyway
+                sweep_cursor = free_list_head;
+                stale_blocks--;
+            }
+        }
+        else
+        {
+            // free list is empty, take the next never used block
+            free_block = blocks_touched++;
+        }
         free_block_count--;
-        // Remove free block from list
 
-        blocks[free_block].used = true;
-        blocks[free_block].next_block = -1;
+        used.set(free_block);
 
         return free_block;
     }
 
+    // first free block at or after goal in goal's allocation group that is
+    // on the free list or the next never used one, -1 if there is none
+    int freeBlockNear(int goal)
+    {
+        if (goal >= geometry.num_blocks)
+            return -1;
+        int group_end = (int)min<long long>((long long)(goal / group_blocks + 1) * group_blocks, geometry.num_blocks);
+        int block = used.findFirstFree(goal);
+        if (block == -1 || block >= group_end || block > blocks_touched)
+            return -1; // blocks past blocks_touched are only handed out in order
+        return block;
+    }
+
+    void unlinkFree(int block)
+    {
+        int prev = table.prev(block), next = table.next(block);
+        if (prev == -1)
+            free_list_head = next;
+        else
+            table.next(prev) = next;
+        if (next != -1)
+            table.prev(next) = prev;
+        else
+            free_list_tail = prev;
+    }
+
     void incrementBlockCount(int count)
     {
         total_block_count = total_block_count + count;
@@ -213,11 +645,269 @@ private:
     }
 };
 
-int main()
+// Seeks to random blocks of linked files of growing size, once walking the
+// chain from its first block and once through the skip index, and prints
+// the time per seek and the metadata bytes per disk block of both. Each
+// file fills the holes of a disk where every other block is used.
+void runSkipIndexBenchmark(DiskGeometry geometry)
+{
+    const int SEEKS = 2000;
+    cout << "\nlinked seeks (" << SEEKS << " random blocks per file)\n";
+    cout << "File blocks\t Walk (ns)\t Skip index (ns)\t Metadata bytes/block walk/skip\n";
+    cout << "=================================================================================\n";
+    for (long long file_blocks = 1 << 10; file_blocks <= geometry.num_blocks / 4; file_blocks *= 8)
+    {
+        double ns[2];
+        size_t bytes[2];
+        for (bool skip : {false, true})
+        {
+            FileSystem fs(geometry, skip);
+            for (long long b = 0; b < file_blocks; b++)
+                for (const char *name : {"a", "b"})
+                    fs.createOrModifyFile(name + to_string(b), geometry.block_size);
+            for (long long b = 0; b < file_blocks; b++)
+                fs.deleteFile("a" + to_string(b));
+            fs.useGoalAllocation(false); // straight off the free list, into the holes
+            fs.createOrModifyFile("large", file_blocks * geometry.block_size);
+
+            mt19937 rng(3);
+            uniform_int_distribution<long long> which(0, file_blocks - 1);
+            long long found = 0;
+            auto start = high_resolution_clock::now();
+            for (int i = 0; i < SEEKS; i++)
+                found += fs.blockAt("large", which(rng)) != -1;
+            ns[skip] = duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / SEEKS;
+            bytes[skip] = found == SEEKS ? fs.metadataBytes() : 0;
+        }
+        cout << file_blocks << "\t\t " << ns[0] << "\t\t " << ns[1] << "\t\t " << (double)bytes[0] / geometry.num_blocks
+             << " / " << (double)bytes[1] / geometry.num_blocks << "\n";
+    }
+}
+
+// Appends a block to and truncates a block off linked files of growing
+// size, then deletes them, and prints the time per operation. Modifications
+// touch only the blocks they add or cut and a delete splices the chain onto
+// the free list, so the times should not grow with the file.
+void runChainBenchmark(DiskGeometry geometry)
+{
+    const int RESIZES = 10000;
+    cout << "\nlinked append, truncate and delete (" << RESIZES << " one block appends and truncates per file)\n";
+    cout << "File blocks\t Append (ns)\t Truncate (ns)\t Delete (ns)\n";
+    cout << "=================================================================\n";
+    for (long long file_blocks = 1 << 12; file_blocks <= geometry.num_blocks / 2; file_blocks *= 8)
+    {
+        FileSystem fs(geometry);
+        long long size = file_blocks * geometry.block_size;
+        fs.createOrModifyFile("large", size);
+        auto nsSince = [](high_resolution_clock::time_point start, int ops)
+        { return duration_cast<duration<double, nano>>(high_resolution_clock::now() - start).count() / ops; };
+
+        double append_ns = 0, truncate_ns = 0;
+        for (int i = 0; i < RESIZES; i++)
+        {
+            auto start = high_resolution_clock::now();
+            fs.appendFile("large", geometry.block_size);
+            append_ns += nsSince(start, RESIZES);
+            start = high_resolution_clock::now();
+            fs.createOrModifyFile("large", size);
+            truncate_ns += nsSince(start, RESIZES);
+        }
+        auto start = high_resolution_clock::now();
+        fs.deleteFile("large");
+        double delete_ns = nsSince(start, 1);
+        cout << file_blocks << "\t\t " << append_ns << "\t\t " << truncate_ns << "\t\t " << delete_ns << "\n";
+    }
+}
+
+// Reads a linked file whose blocks fill every other block of the disk
+// image, cold from the disk, once walking the chain a block read at a time
+// and once through the readahead thread, and a file of the same size in one
+// contiguous run of blocks with a single read, and prints the throughput.
+// The image is synced, reopened so none of it is mapped, and dropped from
+// the page cache before each read.
+void runReadaheadBenchmark(DiskGeometry geometry, const string &image)
+{
+    const long long FILE_BLOCKS = geometry.num_blocks / 4;
+    const long long bytes = FILE_BLOCKS * geometry.block_size;
+    FileSystem fs(geometry);
+    BlockDevice device;
+    if (!device.open(image, geometry))
+        return;
+    fs.attachDevice(&device);
+    for (long long b = 0; b < FILE_BLOCKS; b++)
+        for (const char *name : {"a", "b"})
+            fs.createOrModifyFile(name + to_string(b), geometry.block_size);
+    for (long long b = 0; b < FILE_BLOCKS; b++)
+        fs.deleteFile("a" + to_string(b));
+    fs.useGoalAllocation(false); // into the holes
+    fs.createOrModifyFile("chain", bytes);
+    fs.useGoalAllocation(true); // one run after the used blocks
+    fs.createOrModifyFile("run", bytes);
+
+    vector<char> data(geometry.block_size);
+    for (const char *name : {"chain", "run"})
+        for (long long b = 0; b < FILE_BLOCKS; b++)
+        {
+            fill(data.begin(), data.end(), (char)('a' + b % 26));
+            device.write(fs.blockAt(string(name), b), 0, data.data(), data.size());
+        }
+    device.sync();
+
+    cout << "\nlinked sequential reads, cold (" << bytes / (1 << 20) << " MB file, image " << image << ")\n";
+    cout << "Layout\t\t\t MB/s\t\t Stalls\t Max depth\n";
+    cout << "=================================================================\n";
+    vector<char> buffer(bytes);
+    auto coldRead = [&](const char *layout, auto read)
+    {
+        device.open(image, geometry);
+        fs.attachDevice(&device);
+        posix_fadvise(device.fileDescriptor(), 0, 0, POSIX_FADV_DONTNEED);
+        auto start = high_resolution_clock::now();
+        long long got = read();
+        double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        bool intact = got == bytes;
+        for (long long b = 0; intact && b < FILE_BLOCKS; b++)
+            intact = buffer[b * geometry.block_size] == (char)('a' + b % 26);
+        const ChainReadahead *readahead = fs.readaheadStats();
+        cout << layout << "\t " << (intact ? bytes / seconds / (1 << 20) : 0) << "\t\t "
+             << (readahead ? readahead->stalls() : 0) << "\t " << (readahead ? readahead->maxDepth() : 0) << "\n";
+    };
+    fs.useReadahead(false);
+    coldRead("chain, block by block", [&]
+             { return fs.readFileData("chain", buffer.data(), bytes); });
+    fs.useReadahead(true);
+    coldRead("chain, readahead", [&]
+             { return fs.readFileData("chain", buffer.data(), bytes); });
+    coldRead("contiguous run\t", [&]
+             { return (long long)pread(device.fileDescriptor(), buffer.data(), bytes,
+                                       (off_t)fs.blockAt(string("run"), 0) * geometry.block_size); });
+    device.close();
+    unlink(image.c_str());
+}
+
+// Runs a mix of creates, appends and deletes on a journaled file system
+// for a while with every combination of batch size and commit interval and
+// prints the metadata operations committed per second and the commits it
+// took. Then rebuilds the file system of the last run from its journal and
+// checks that every file has the chain it had.
+void runJournalBenchmark(DiskGeometry geometry, const string &path)
 {
+    const int NAMES = 256;
+    const auto RUN_TIME = milliseconds(250);
+    cout << "\nlinked metadata journal (group commit, " << path << ")\n";
+    cout << "Batch records\t Interval (us)\t Commits\t Committed ops/s\n";
+    cout << "=================================================================\n";
+    unique_ptr<FileSystem> fs;
+    for (size_t batch : {1, 8, 64, 512})
+        for (long long interval_us : {100, 1000, 10000})
+        {
+            unlink(path.c_str());
+            fs.reset(); // one file system at a time, they share the free list globals
+            fs.reset(new FileSystem(geometry));
+            MetadataJournal journal;
+            if (!journal.open(path, batch, microseconds(interval_us)))
+                return;
+            fs->attachJournal(&journal);
+            mt19937 rng(11);
+            uniform_int_distribution<int> which(0, NAMES - 1), blocks(1, 16);
+            auto start = steady_clock::now();
+            for (int i = 0; steady_clock::now() - start < RUN_TIME; i++)
+            {
+                string name = "f" + to_string(which(rng));
+                if (i % 4 < 2)
+                    fs->createOrModifyFile(name, blocks(rng) * geometry.block_size);
+                else if (i % 4 == 2)
+                    fs->appendFile(name, geometry.block_size);
+                else
+                    fs->deleteFile(name);
+            }
+            journal.close();
+            double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+            cout << batch << "\t\t " << interval_us << "\t\t " << journal.commits() << "\t\t "
+                 << journal.committedRecords() / seconds << "\n";
+        }
+
+    map<string, JournaledFile> files;
+    long long records = MetadataJournal::replay(path, files);
+    FileSystem recovered(geometry);
+    auto start = steady_clock::now();
+    bool done = recovered.recover(path);
+    double ms = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+    bool same = done;
+    for (int n = 0; same && n < NAMES; n++)
+    {
+        string name = "f" + to_string(n);
+        for (long long b = 0; same && (b == 0 || fs->blockAt(name, b - 1) != -1); b++)
+            same = fs->blockAt(name, b) == recovered.blockAt(name, b);
+    }
+    cout << "Recovered " << files.size() << " files from " << records << " records in " << ms << " ms, chains "
+         << (same ? "match" : "DIFFER") << "\n";
+
+    // a checkpoint leaves one record per file to replay
+    MetadataJournal journal;
+    if (done && journal.open(path))
+    {
+        recovered.attachJournal(&journal);
+        start = steady_clock::now();
+        bool checkpointed = recovered.checkpointJournal();
+        ms = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+        journal.close();
+        files.clear();
+        records = MetadataJournal::replay(path, files);
+        FileSystem again(geometry);
+        start = steady_clock::now();
+        done = checkpointed && again.recover(path);
+        double again_ms = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+        for (int n = 0; done && n < NAMES; n++)
+        {
+            string name = "f" + to_string(n);
+            for (long long b = 0; done && (b == 0 || fs->blockAt(name, b - 1) != -1); b++)
+                done = fs->blockAt(name, b) == again.blockAt(name, b);
+        }
+        cout << "Checkpoint took " << ms << " ms, then recovered " << files.size() << " files from " << records
+             << " records in " << again_ms << " ms, chains " << (done ? "match" : "DIFFER") << "\n";
+    }
+    unlink(path.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    if (hasFlag(argc, argv, "--bench"))
+    {
+        log_ops = false;
+        runScalingBenchmark<FileSystem>("linked", parseGeometry(argc, argv, {4096, 1 << 28}));
+        runBatchBenchmark<FileSystem>("linked", {4096, 1 << 20}, 10000);
+        runLocalityBenchmark<FileSystem>("linked", {4096, 1 << 20});
+        runRandomReadBenchmark<FileSystem>("linked", {4096, 1 << 20});
+        runSkipIndexBenchmark({4096, 1 << 21});
+        runChainBenchmark({4096, 1 << 21});
+        runReadaheadBenchmark({4096, 1 << 16}, flagString(argc, argv, "--readahead-image", "readahead.img"));
+        runJournalBenchmark({4096, 1 << 20}, flagString(argc, argv, "--journal", "bench.journal"));
+        return 0;
+    }
+
     freopen("log.txt", "a", stdout);
 
-    FileSystem fs;
+    DiskGeometry geometry = parseGeometry(argc, argv, DEFAULT_GEOMETRY);
+    FileSystem fs(geometry, !hasFlag(argc, argv, "--no-skip"));
+    fs.useGoalAllocation(!hasFlag(argc, argv, "--no-goal"));
+    fs.useReadahead(!hasFlag(argc, argv, "--no-readahead"));
+    BlockDevice device;
+    if (device.open(flagString(argc, argv, "--image", "linked.img"), geometry))
+        fs.attachDevice(&device);
+    // with --journal=path the files of earlier runs come back from the journal and changes are logged to it
+    MetadataJournal journal;
+    string journal_path = flagString(argc, argv, "--journal", "");
+    if (!journal_path.empty())
+    {
+        if (!fs.recover(journal_path))
+            cerr << "Error: could not recover from journal " << journal_path << endl;
+        else if (journal.open(journal_path))
+        {
+            fs.attachJournal(&journal);
+            fs.checkpointJournal(); // the next run replays the files, not their history
+        }
+    }
 
     cout << "\n------------------------------------------Start-------------------------------------------------\n";
 
@@ -246,7 +936,17 @@ int main()
 
     fs.readFile("file2.txt");
 
-    long max_rss = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    fs.createBatch({{"batch1.txt", 4096}, {"batch2.txt", 12288}});
+    fs.readFile("batch2.txt");
+    char buffer[16];
+    cout << "Read " << fs.pread("batch2.txt", 2 * 4096 + 100, buffer, sizeof(buffer)) << " bytes at offset "
+         << 2 * 4096 + 100 << " of batch2.txt\n";
+    vector<char> contents(12288);
+    cout << "Read " << fs.readFileData("batch2.txt", contents.data(), contents.size()) << " bytes of batch2.txt\n";
+    fs.appendFile("batch2.txt", 4096);
+    fs.createOrModifyFile("batch2.txt", 8192);
+    fs.deleteBatch({"batch1.txt", "batch2.txt", "file2.txt"});
+    journal.close(); // commits what is still waiting, exit() below skips destructors
 
     // Get the maximum resident set size
     ifstream status("/proc/self/status");
@@ -267,8 +967,11 @@ int main()
     }
     status.close();
     // Convert to megabytes
+    cout << "\nOperation latencies:\n";
+    fs.opMetrics().dump(cout);
+
     cout << "Total blocks used : " << total_block_count << endl;
-    cout << "Total memory used by blocks : " << total_block_count * BLOCK_SIZE << "bytes\n";
+    cout << "Total memory used by blocks : " << (long long)total_block_count * geometry.block_size << "bytes\n";
     cout << "\n-----------end of linked ---------------------\n";
 
     exit(0);
@@ -0,0 +1,457 @@
+#ifndef METADATA_JOURNAL_H
+#define METADATA_JOURNAL_H
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum class JournalOp : uint8_t
+{
+    CREATE = 1, // a new file with the blocks of runs
+    MODIFY = 2, // keeps its first kept blocks, then the blocks of runs
+    DELETE = 3
+};
+
+// a run of blocks next to each other on the disk
+struct JournalRun
+{
+    int start;
+    int length;
+};
+
+// one change to a file's metadata, its size and where its blocks are
+struct JournalRecord
+{
+    JournalOp op;
+    std::string name;
+    long long size = 0;
+    long long kept = 0;
+    std::vector<JournalRun> runs;
+};
+
+// a file as the journal left it, blocks in file order
+struct JournaledFile
+{
+    long long size = 0;
+    std::vector<int> blocks;
+};
+
+// Write-ahead journal of file metadata in a local file.
+//
+// Records are encoded into a batch in memory; a batch is committed with one
+// write and one fdatasync once batch_records records are waiting, or by a
+// flusher thread once the first of them has waited commit_interval, or when
+// commit() or close() is called. Each commit is a frame: a header with a
+// magic number, the record count, the payload length and an FNV-1a checksum
+// of the payload, then the records. A crash loses at most the records of
+// the last commit interval; a frame torn by the crash fails its checksum,
+// and replay stops there and open() cuts it off.
+//
+// Records are physical, they name the blocks a file gained, so replaying
+// them gives back the exact placement whatever the allocator would pick.
+// The journal only grows until checkpoint() replaces it with one frame that
+// creates the files as they are now.
+class MetadataJournal
+{
+public:
+    MetadataJournal() : fd(-1) {}
+    ~MetadataJournal() { close(); }
+
+    MetadataJournal(const MetadataJournal &) = delete;
+    MetadataJournal &operator=(const MetadataJournal &) = delete;
+
+    // open (or create) the journal at path for appending after its last whole frame
+    bool open(const std::string &journal_path, size_t batch_records = 64,
+              std::chrono::microseconds commit_interval = std::chrono::milliseconds(1))
+    {
+        close();
+        path = journal_path;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Error: could not open journal " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        end = scan(fd, [](const JournalRecord &) {});
+        if (end < 0 || ftruncate(fd, end) != 0)
+        {
+            std::cerr << "Error: could not read journal " << path << ": " << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        max_records = batch_records ? batch_records : 1;
+        interval = commit_interval;
+        startBatch();
+        stopping = false;
+        flusher = std::thread([this]
+                              { flushWaiting(); });
+        return true;
+    }
+
+    // commits what is waiting and closes the file
+    void close()
+    {
+        if (flusher.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> guard(batch_mutex);
+                stopping = true;
+            }
+            batch_waiting.notify_all();
+            flusher.join();
+        }
+        if (fd < 0)
+            return;
+        commit();
+        ::close(fd);
+        fd = -1;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    void log(const JournalRecord &record)
+    {
+        if (fd < 0)
+            return;
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(batch_mutex);
+            if (pending_records == 0)
+            {
+                batch_start = std::chrono::steady_clock::now();
+                batch_waiting.notify_one(); // the flusher times the batch from now
+            }
+            encode(record, batch);
+            full = ++pending_records >= max_records;
+        }
+        if (full)
+            commit();
+    }
+
+    // writes the waiting records as one frame and waits for them to reach the disk
+    bool commit()
+    {
+        std::lock_guard<std::mutex> in_order(commit_mutex);
+        std::vector<char> frame;
+        size_t records;
+        {
+            std::lock_guard<std::mutex> guard(batch_mutex);
+            if (fd < 0 || pending_records == 0)
+                return true;
+            frame.swap(batch);
+            records = pending_records;
+            startBatch();
+        }
+        if (!writeFrame(fd, end, frame, records))
+            return false;
+        end += frame.size();
+        commit_count++;
+        committed_records += records;
+        return true;
+    }
+
+    // Replaces the journal with a single frame that creates files as they
+    // are, so recovery no longer replays their history. Records still
+    // waiting are dropped: files already has their changes. The new journal
+    // is written next to the old one, synced and renamed over it. False if
+    // the rename could not be made durable; the new journal is used anyway.
+    bool checkpoint(const std::map<std::string, JournaledFile> &files)
+    {
+        std::lock_guard<std::mutex> in_order(commit_mutex);
+        if (fd < 0)
+            return false;
+        std::vector<char> frame(sizeof(FrameHeader), 0);
+        for (const auto &entry : files)
+        {
+            JournalRecord record{JournalOp::CREATE, entry.first, entry.second.size, 0, {}};
+            for (int block : entry.second.blocks)
+            {
+                if (!record.runs.empty() && record.runs.back().start + record.runs.back().length == block)
+                    record.runs.back().length++;
+                else
+                    record.runs.push_back({block, 1});
+            }
+            encode(record, frame);
+        }
+        std::string temporary = path + ".checkpoint";
+        int out = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || !writeFrame(out, 0, frame, files.size()) || fsync(out) != 0 ||
+            rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::cerr << "Error: could not checkpoint journal " << path << ": " << strerror(errno) << std::endl;
+            if (out >= 0)
+                ::close(out);
+            unlink(temporary.c_str());
+            return false;
+        }
+        // the rename is only durable once the directory is; until then a
+        // crash can bring the old journal back, without what is appended now
+        bool durable = syncDirectory(path);
+        if (!durable)
+            std::cerr << "Error: could not sync the directory of journal " << path << ": " << strerror(errno) << std::endl;
+        {
+            std::lock_guard<std::mutex> guard(batch_mutex);
+            startBatch();
+        }
+        ::close(fd);
+        fd = out;
+        end = frame.size();
+        return durable;
+    }
+
+    long long commits() const { return commit_count; }
+    long long committedRecords() const { return committed_records; }
+    size_t pendingRecords()
+    {
+        std::lock_guard<std::mutex> guard(batch_mutex);
+        return pending_records;
+    }
+
+    // Replays the committed records of the journal at path into files, the
+    // files it describes by name. Returns the records replayed, -1 if the
+    // journal could not be read. A missing journal has no records.
+    static long long replay(const std::string &path, std::map<std::string, JournaledFile> &files)
+    {
+        int in = ::open(path.c_str(), O_RDONLY);
+        if (in < 0)
+            return errno == ENOENT ? 0 : -1;
+        long long records = 0;
+        long long valid = scan(in, [&](const JournalRecord &record)
+                               {
+            records++;
+            if (record.op == JournalOp::DELETE)
+            {
+                files.erase(record.name);
+                return;
+            }
+            JournaledFile &file = files[record.name];
+            if (record.op == JournalOp::CREATE)
+                file.blocks.clear();
+            else if (record.kept < (long long)file.blocks.size())
+                file.blocks.resize(record.kept);
+            file.size = record.size;
+            for (const JournalRun &run : record.runs)
+                for (int b = 0; b < run.length; b++)
+                    file.blocks.push_back(run.start + b); });
+        ::close(in);
+        return valid < 0 ? -1 : records;
+    }
+
+private:
+    static constexpr uint32_t MAGIC = 0x4c4e4a4d; // "MJNL"
+
+    struct FrameHeader
+    {
+        uint32_t magic;
+        uint32_t records;
+        uint64_t payload_bytes;
+        uint64_t checksum;
+    };
+
+    std::string path;
+    int fd;
+    long long end = 0; // bytes of whole frames in the file, where the next one goes
+    size_t max_records = 64;
+    std::chrono::microseconds interval{1000};
+    std::atomic<long long> commit_count{0};
+    std::atomic<long long> committed_records{0};
+
+    std::mutex commit_mutex; // one commit or checkpoint at a time, so frames land in order
+    std::mutex batch_mutex;  // guards the batch and stopping
+    std::condition_variable batch_waiting;
+    std::vector<char> batch; // frame header space, then the records waiting for a commit
+    size_t pending_records = 0;
+    std::chrono::steady_clock::time_point batch_start;
+    std::thread flusher;
+    bool stopping = false;
+
+    // the flusher thread: commits a batch once its first record has waited the interval
+    void flushWaiting()
+    {
+        std::unique_lock<std::mutex> guard(batch_mutex);
+        while (!stopping)
+        {
+            if (pending_records == 0)
+                batch_waiting.wait(guard);
+            else if (std::chrono::steady_clock::now() < batch_start + interval)
+                batch_waiting.wait_until(guard, batch_start + interval);
+            else
+            {
+                guard.unlock();
+                commit();
+                guard.lock();
+            }
+        }
+    }
+
+    // fsyncs the directory that holds file, so entries renamed into it last
+    static bool syncDirectory(const std::string &file)
+    {
+        size_t slash = file.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : file.substr(0, slash);
+        int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir < 0)
+            return false;
+        bool synced = fsync(dir) == 0;
+        ::close(dir);
+        return synced;
+    }
+
+    void startBatch()
+    {
+        batch.assign(sizeof(FrameHeader), 0);
+        pending_records = 0;
+    }
+
+    template <typename T>
+    static void put(std::vector<char> &out, T value)
+    {
+        const char *bytes = (const char *)&value;
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    static void encode(const JournalRecord &record, std::vector<char> &out)
+    {
+        put<uint8_t>(out, (uint8_t)record.op);
+        put<uint32_t>(out, (uint32_t)record.name.size());
+        out.insert(out.end(), record.name.begin(), record.name.end());
+        put<int64_t>(out, record.size);
+        put<int64_t>(out, record.kept);
+        put<uint32_t>(out, (uint32_t)record.runs.size());
+        for (const JournalRun &run : record.runs)
+        {
+            put<int32_t>(out, run.start);
+            put<int32_t>(out, run.length);
+        }
+    }
+
+    // fills in the header of frame, which has records records after it, and
+    // writes it to out at offset, then waits for it to reach the disk
+    static bool writeFrame(int out, long long offset, std::vector<char> &frame, size_t records)
+    {
+        FrameHeader header{MAGIC, (uint32_t)records, frame.size() - sizeof(FrameHeader),
+                           checksum(frame.data() + sizeof(FrameHeader), frame.size() - sizeof(FrameHeader))};
+        memcpy(frame.data(), &header, sizeof(header));
+        for (size_t done = 0; done < frame.size();)
+        {
+            ssize_t wrote = pwrite(out, frame.data() + done, frame.size() - done, offset + done);
+            if (wrote < 0 && errno == EINTR)
+                continue;
+            if (wrote <= 0)
+            {
+                std::cerr << "Error: could not write journal: " << strerror(errno) << std::endl;
+                return false;
+            }
+            done += wrote;
+        }
+        if (fdatasync(out) != 0)
+        {
+            std::cerr << "Error: could not sync journal: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static uint64_t checksum(const char *data, size_t length)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; i++)
+            hash = (hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+        return hash;
+    }
+
+    // Calls fn for every record of every whole frame of the file in order
+    // and returns the offset after the last whole frame, -1 on a read error.
+    template <typename Fn>
+    static long long scan(int in, Fn fn)
+    {
+        long long offset = 0;
+        std::vector<char> payload;
+        while (true)
+        {
+            FrameHeader header;
+            if (!readAll(in, (char *)&header, sizeof(header), offset))
+                return errno ? -1 : offset;
+            if (header.magic != MAGIC || header.payload_bytes > (1ULL << 32))
+                return offset;
+            payload.resize(header.payload_bytes);
+            if (!readAll(in, payload.data(), payload.size(), offset + sizeof(header)))
+                return errno ? -1 : offset;
+            if (checksum(payload.data(), payload.size()) != header.checksum)
+                return offset;
+
+            std::vector<JournalRecord> records(header.records);
+            size_t at = 0;
+            for (JournalRecord &record : records)
+                if (!decode(payload, at, record))
+                    return offset;
+            for (const JournalRecord &record : records)
+                fn(record);
+            offset += sizeof(header) + payload.size();
+        }
+    }
+
+    // false at the end of the file (errno 0) or on an error
+    static bool readAll(int in, char *buffer, size_t length, long long offset)
+    {
+        errno = 0;
+        for (size_t done = 0; done < length;)
+        {
+            ssize_t got = pread(in, buffer + done, length - done, offset + done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            done += got;
+        }
+        return true;
+    }
+
+    static bool decode(const std::vector<char> &payload, size_t &at, JournalRecord &record)
+    {
+        auto get = [&](auto &value)
+        {
+            if (at + sizeof(value) > payload.size())
+                return false;
+            memcpy(&value, payload.data() + at, sizeof(value));
+            at += sizeof(value);
+            return true;
+        };
+        uint8_t op;
+        uint32_t name_length, num_runs;
+        int64_t size, kept;
+        if (!get(op) || op < (uint8_t)JournalOp::CREATE || op > (uint8_t)JournalOp::DELETE || !get(name_length) ||
+            at + name_length > payload.size())
+            return false;
+        record.op = (JournalOp)op;
+        record.name.assign(payload.data() + at, name_length);
+        at += name_length;
+        if (!get(size) || !get(kept) || !get(num_runs) || num_runs > (payload.size() - at) / 8)
+            return false;
+        record.size = size;
+        record.kept = kept;
+        record.runs.resize(num_runs);
+        for (JournalRun &run : record.runs)
+        {
+            int32_t start = 0, length = 0;
+            get(start);
+            get(length);
+            run = {start, length};
+        }
+        return true;
+    }
+};
+
+#endif
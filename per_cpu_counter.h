@@ -0,0 +1,69 @@
+#ifndef PER_CPU_COUNTER_H
+#define PER_CPU_COUNTER_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Counter that is cheap to update from many threads.
+//
+// Every CPU adds into its own slot, each slot on its own cache line, so
+// concurrent updates do not bounce a shared line between cores. The slot
+// is picked with sched_getcpu; a thread that migrates mid-update only lands
+// in another CPU's slot, which is still correct because slots are atomic.
+// Reading sums all slots, so it is meant for the rare reader.
+class PerCpuCounter
+{
+public:
+    PerCpuCounter()
+    {
+        size_t count = 1;
+        while (count < std::thread::hardware_concurrency())
+            count *= 2;
+        slots = std::vector<Slot>(count);
+    }
+
+    void add(long long delta)
+    {
+        slots[currentCpu() & (slots.size() - 1)].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    long long read() const
+    {
+        long long total = 0;
+        for (const Slot &slot : slots)
+            total += slot.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    void reset()
+    {
+        for (Slot &slot : slots)
+            slot.value.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<long long> value{0};
+    };
+    std::vector<Slot> slots; // power of two sized
+
+    static unsigned currentCpu()
+    {
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if (cpu >= 0)
+            return cpu;
+#endif
+        // no cpu number, give every thread a slot of its own instead
+        static std::atomic<unsigned> next_thread{0};
+        thread_local unsigned thread_slot = next_thread++;
+        return thread_slot;
+    }
+};
+
+#endif
@@ -3,10 +3,13 @@
 #include <time.h>
 #include <chrono>
 #include <bits/stdc++.h>
+#include "backing_store.h"
+#include "disk_geometry.h"
 
 #define NOOFFILES 3 // No of data loads
 #define NOOFFRAMES 8 // No of frames in RAM
 #define NOOFREQ 100 // No of page request to be generated
+#define PAGESIZE 8 // Bytes in a page
 
 using namespace std;
 using namespace std::chrono; // for time stamps
@@ -42,24 +45,21 @@ int dataGenerator(int limit)
     return rand() % limit;
 }
 
-// Read a pg from the program
-string readFromFile(string program, int pgNo)
+// Read a pg from the program's backing store, adding the time it took to faultTime
+string readFromFile(BackingStore &store, int pgNo, long long &faultTime)
 {
-    ifstream swapMemory(program);
-    swapMemory.seekg(pgNo * 8, ios::beg);
-    char A[9];
-    swapMemory.read(A, 8);
-    A[8] = 0;
-    string s(A);
-    swapMemory.close();
+    auto start = high_resolution_clock::now();
+    string s = store.readPage(pgNo);
+    faultTime += duration_cast<nanoseconds>(high_resolution_clock::now() - start).count();
 
     return s;
 }
 
 // MRU implemention
-void mru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string program, int size, vector<int> reqStr)
+void mru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string program, BackingStore &store, int size, vector<int> reqStr)
 {
     int pgfault = 0, last = 0;
+    long long faultTime = 0; // ns spent reading pages in
     list<int> dq;                               // Deque to store the order of pages
     unordered_map<int, list<int>::iterator> mp; // Hashmap to store location of loaded pg in the deque
 
@@ -99,7 +99,7 @@ void mru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
                 mp[reqStr[i]] = dq.begin(); // make a entry with the location in deque of pg
 
                 // read the requested pg
-                RAM[outFrameIndex] = readFromFile(program, reqStr[i]);
+                RAM[outFrameIndex] = readFromFile(store, reqStr[i], faultTime);
 
                 // make the entry in the page table
                 pgTable[reqStr[i]].first = outFrameIndex;
@@ -111,7 +111,7 @@ void mru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
             {
                 // if capacity of RAM is not full
                 //  read the requested pg
-                RAM[last] = readFromFile(program, reqStr[i]);
+                RAM[last] = readFromFile(store, reqStr[i], faultTime);
 
                 // make the entry in the page table
                 pgTable[reqStr[i]].first = last;
@@ -159,7 +159,7 @@ void mru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
                      ((sizeof(int) + sizeof(list<int>::iterator)) * mp.size()) + sizeof(mp) +
                      ((sizeof(int) + sizeof(pair<int, bool>)) * pgTable.size()) + sizeof(pgTable);
 
-    cout << size << "\t\t  " << memorySize << "\t\t  " << duration.count() << "\t\t\t  " << pgfault << "\t\t\t MRU\n";
+    cout << size << "\t\t  " << memorySize << "\t\t  " << duration.count() << "\t\t\t  " << pgfault << "\t\t\t  " << faultTime / max(pgfault, 1) << "\t\t\t MRU\n";
 
     log << "Page Faults " << pgfault << "\n";
     log << "\n ===================================== \n";
@@ -168,9 +168,10 @@ void mru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
 }
 
 // LRU implemention
-void lru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string program, int size, vector<int> reqStr)
+void lru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string program, BackingStore &store, int size, vector<int> reqStr)
 {
     int pgfault = 0, last = 0;
+    long long faultTime = 0; // ns spent reading pages in
     list<int> dq;                               // Deque to store the order of pages
     unordered_map<int, list<int>::iterator> mp; // Hashmap to store location of loaded pg in the deque
 
@@ -209,7 +210,7 @@ void lru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
                 mp[reqStr[i]] = dq.begin(); // make a entry with the location in deque of pg
 
                 // read the requested pg
-                RAM[outFrameIndex] = readFromFile(program, reqStr[i]);
+                RAM[outFrameIndex] = readFromFile(store, reqStr[i], faultTime);
 
                 // make the entry in the page table
                 pgTable[reqStr[i]].first = outFrameIndex;
@@ -220,7 +221,7 @@ void lru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
             else
             {
                 // read the requested pg
-                RAM[last] = readFromFile(program, reqStr[i]);
+                RAM[last] = readFromFile(store, reqStr[i], faultTime);
 
                 // make the entry in the page table
                 pgTable[reqStr[i]].first = last;
@@ -268,7 +269,7 @@ void lru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
                      ((sizeof(int) + sizeof(list<int>::iterator)) * mp.size()) + sizeof(mp) +
                      ((sizeof(int) + sizeof(pair<int, bool>)) * pgTable.size()) + sizeof(pgTable);
 
-    cout << size << "\t\t  " << memorySize << "\t\t  " << duration.count() << "\t\t\t  " << pgfault << "\t\t\t LRU\n";
+    cout << size << "\t\t  " << memorySize << "\t\t  " << duration.count() << "\t\t\t  " << pgfault << "\t\t\t  " << faultTime / max(pgfault, 1) << "\t\t\t LRU\n";
 
     log << "Page Faults " << pgfault << "\n";
     log << "\n ===================================== \n";
@@ -277,9 +278,10 @@ void lru(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string prog
 }
 
 // FIFO implemenetation
-void fifo(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string program, int size, vector<int> reqStr)
+void fifo(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string program, BackingStore &store, int size, vector<int> reqStr)
 {
     int pgfault = 0, last = 0;
+    long long faultTime = 0; // ns spent reading pages in
     queue<int> q; // Store pg sequence for FIFO
 
     ofstream log("log_" + program, ios::app);
@@ -295,7 +297,7 @@ void fifo(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string pro
         {
             pgfault++;
             log << "Status - Page fault\n";
-            string s = readFromFile(program, reqStr[i]); // read pg from the program
+            string s = readFromFile(store, reqStr[i], faultTime); // read pg from the program
             // If capacity of RAM is full
             if (last >= NOOFFRAMES)
             {
@@ -363,11 +365,14 @@ void fifo(string RAM[], unordered_map<int, pair<int, bool>> &pgTable, string pro
     // Memory used to implement FIFO + Page table size
     int memorySize = sizeof(int) * NOOFFRAMES + ((sizeof(int) + sizeof(pair<int, bool>)) * pgTable.size()) + sizeof(pgTable);
 
-    cout << size << "\t\t  " << memorySize << "\t\t  " << duration.count() << "\t\t\t  " << pgfault << "\t\t\t FIFO\n";
+    cout << size << "\t\t  " << memorySize << "\t\t  " << duration.count() << "\t\t\t  " << pgfault << "\t\t\t  " << faultTime / max(pgfault, 1) << "\t\t\t FIFO\n";
 }
 
-int swappingSystem(string program, int size)
+int swappingSystem(string program, int size, BackingStore::Mode mode, size_t cachePages)
 {
+    BackingStore store; // the program stays open while its requests are served
+    if (!store.open(program, PAGESIZE, mode, cachePages))
+        return 0;
     string RAM[NOOFFRAMES];
     unordered_map<int, pair<int, bool>> pgTable; // Pg Table stores the frame no and bool stores if the pg is loaded
     int noOfpages;
@@ -376,7 +381,7 @@ int swappingSystem(string program, int size)
 
     log << program << " Request String\n";
 
-    noOfpages = size / 8;
+    noOfpages = size / PAGESIZE;
 
     // Create the page request string
     for (int i = 0; i < NOOFREQ; i++)
@@ -394,7 +399,7 @@ int swappingSystem(string program, int size)
         pgTable[i].first = -1;
         pgTable[i].second = false;
     }
-    fifo(RAM, pgTable, program, size, reqStr);
+    fifo(RAM, pgTable, program, store, size, reqStr);
 
     // Intialise page table
     for (int i = 0; i < noOfpages; i++)
@@ -402,7 +407,7 @@ int swappingSystem(string program, int size)
         pgTable[i].first = -1;
         pgTable[i].second = false;
     }
-    lru(RAM, pgTable, program, size, reqStr);
+    lru(RAM, pgTable, program, store, size, reqStr);
 
     // Intialise page table
     for (int i = 0; i < noOfpages; i++)
@@ -410,15 +415,23 @@ int swappingSystem(string program, int size)
         pgTable[i].first = -1;
         pgTable[i].second = false;
     }
-    mru(RAM, pgTable, program, size, reqStr);
+    mru(RAM, pgTable, program, store, size, reqStr);
 
     return 1;
 }
 
-int main()
+// Pages are served from a mapping of each program by default, --pread reads
+// them from its descriptor (with --cache=N through an N page cache) and
+// --reopen opens the program for every fault.
+int main(int argc, char *argv[])
 {
     srand(time(0));
 
+    BackingStore::Mode mode = hasFlag(argc, argv, "--reopen")  ? BackingStore::Mode::REOPEN
+                              : hasFlag(argc, argv, "--pread") ? BackingStore::Mode::PREAD
+                                                               : BackingStore::Mode::MMAP;
+    size_t cachePages = flagValue(argc, argv, "--cache", 0);
+
     string path = "program_";
 
     // Create programs
@@ -431,9 +444,9 @@ int main()
     // Swapping system on all the programs created
     for (int i = 0; i < NOOFFILES; i++)
     {
-        cout << "Data Load\t Memory Usage\t Processing Time\t Page fault Rate\t Swapping Policy\n";
+        cout << "Data Load\t Memory Usage\t Processing Time\t Page fault Rate\t Fault Service (ns)\t Swapping Policy\n";
         cout << "=================================================================================================\n";
-        swappingSystem(path + to_string(i), fileSize[i]);
+        swappingSystem(path + to_string(i), fileSize[i], mode, cachePages);
         cout << "\n=================================================================================================\n";
     }
 
@@ -0,0 +1,268 @@
+#ifndef SCALING_BENCHMARK_H
+#define SCALING_BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "batch.h"
+#include "disk_geometry.h"
+#include "latency_histogram.h"
+#include "seek_distance.h"
+
+// Scaling benchmark shared by the allocators, run with --bench.
+//
+// For every disk size from 2^16 blocks up to the --blocks limit it formats a
+// new FS, fills it with files of 1..64 blocks, deletes every other file so the
+// free space is fragmented, and then times creating, reading and deleting a
+// fixed number of files. The op count does not grow with the disk, so flat
+// ops/sec and metadata bytes/block across the rows means the allocator scales.
+//
+// FS needs a DiskGeometry constructor, createOrModifyFile(name, size),
+// readFile(name), deleteFile(name), metadataBytes() and opMetrics(). The
+// latency percentiles of the largest disk are printed after the table.
+template <typename FS>
+void runScalingBenchmark(const char *layout, DiskGeometry largest)
+{
+    using namespace std::chrono;
+    const int MAX_FILES = 20000;
+
+    std::cout << layout << " scaling benchmark\n";
+    std::cout << "Blocks\t\t Format (ms)\t Create ops/s\t Read ops/s\t Delete ops/s\t Metadata bytes/block\n";
+    std::cout << "=================================================================================================\n";
+    for (long long num_blocks = 1 << 16; num_blocks <= largest.num_blocks; num_blocks *= 16)
+    {
+        DiskGeometry geometry = {largest.block_size, (int)num_blocks};
+        int num_files = (int)std::min<long long>(MAX_FILES, num_blocks / 64);
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> blocks_per_file(1, 64);
+        auto name = [](int i)
+        { return "file" + std::to_string(i); };
+        auto seconds = [](high_resolution_clock::time_point since)
+        { return duration_cast<duration<double>>(high_resolution_clock::now() - since).count(); };
+
+        auto start = high_resolution_clock::now();
+        FS fs(geometry);
+        double format_ms = seconds(start) * 1000;
+
+        // untimed: fill and fragment
+        for (int i = 0; i < num_files; i++)
+            fs.createOrModifyFile(name(i), (long long)blocks_per_file(rng) * geometry.block_size);
+        for (int i = 0; i < num_files; i += 2)
+            fs.deleteFile(name(i));
+
+        std::vector<int> live;
+        for (int i = 1; i < num_files; i += 2)
+            live.push_back(i);
+        int created = 0;
+        start = high_resolution_clock::now();
+        for (int i = num_files; i < num_files + num_files / 2; i++)
+        {
+            if (fs.createOrModifyFile(name(i), (long long)blocks_per_file(rng) * geometry.block_size))
+                live.push_back(i);
+            created++;
+        }
+        double create_rate = created / seconds(start);
+
+        start = high_resolution_clock::now();
+        for (int i : live)
+            fs.readFile(name(i));
+        double read_rate = live.size() / seconds(start);
+
+        double metadata_per_block = (double)fs.metadataBytes() / num_blocks;
+
+        start = high_resolution_clock::now();
+        for (int i : live)
+            fs.deleteFile(name(i));
+        double delete_rate = live.size() / seconds(start);
+
+        std::cout << num_blocks << (num_blocks < 10000000 ? "\t\t " : "\t ")
+                  << format_ms << "\t\t " << (long long)create_rate << "\t\t " << (long long)read_rate
+                  << "\t\t " << (long long)delete_rate << "\t\t " << metadata_per_block << "\n";
+        if (num_blocks * 16 > largest.num_blocks)
+        {
+            std::cout << "\nLatencies of every operation on the " << num_blocks << " block disk\n";
+            fs.opMetrics().dump(std::cout);
+        }
+    }
+
+    // what leaving the instrumentation on costs per operation
+    const int TIMED_OPS = 1000000;
+    OpMetrics metrics;
+    auto start = high_resolution_clock::now();
+    for (int i = 0; i < TIMED_OPS; i++)
+    {
+        OpTimer timer(metrics, Op::READ);
+        timer.succeeded();
+    }
+    double per_op = duration_cast<duration<double, std::nano>>(high_resolution_clock::now() - start).count() / TIMED_OPS;
+    std::cout << "Instrumentation cost: " << per_op << " ns per timed operation\n";
+}
+
+// Creates and deletes batch_size small files on a fragmented disk, first one
+// call per file and then with a single createBatch and deleteBatch, and
+// prints files/sec for both. FS also needs createBatch(requests) and
+// deleteBatch(names) returning one bool per item.
+template <typename FS>
+void runBatchBenchmark(const char *layout, DiskGeometry geometry, int batch_size)
+{
+    using namespace std::chrono;
+    auto seconds = [](high_resolution_clock::time_point since)
+    { return duration_cast<duration<double>>(high_resolution_clock::now() - since).count(); };
+
+    FS fs(geometry);
+    int num_files = (int)std::min<long long>(20000, geometry.num_blocks / 64);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> blocks_per_file(1, 64);
+    for (int i = 0; i < num_files; i++)
+        fs.createOrModifyFile("fill" + std::to_string(i), (long long)blocks_per_file(rng) * geometry.block_size);
+    for (int i = 0; i < num_files; i += 2)
+        fs.deleteFile("fill" + std::to_string(i));
+
+    std::vector<CreateRequest> requests;
+    std::vector<std::string> names;
+    std::uniform_int_distribution<int> small_file(1, 8);
+    for (int i = 0; i < batch_size; i++)
+    {
+        requests.push_back({"small" + std::to_string(i), (long long)small_file(rng) * geometry.block_size});
+        names.push_back(requests.back().name);
+    }
+
+    std::cout << "\n" << layout << " batch benchmark (" << batch_size << " files of 1-8 blocks on "
+              << geometry.num_blocks << " fragmented blocks)\n";
+    std::cout << "Mode\t\t Create files/s\t Delete files/s\t Created\n";
+    std::cout << "=================================================================\n";
+
+    int created = 0;
+    auto start = high_resolution_clock::now();
+    for (const CreateRequest &request : requests)
+        created += fs.createOrModifyFile(request.name, request.size);
+    double create_rate = batch_size / seconds(start);
+    start = high_resolution_clock::now();
+    for (const std::string &name : names)
+        fs.deleteFile(name);
+    double delete_rate = batch_size / seconds(start);
+    std::cout << "one by one\t " << (long long)create_rate << "\t\t " << (long long)delete_rate << "\t\t " << created << "\n";
+
+    start = high_resolution_clock::now();
+    std::vector<bool> results = fs.createBatch(requests);
+    create_rate = batch_size / seconds(start);
+    start = high_resolution_clock::now();
+    fs.deleteBatch(names);
+    delete_rate = batch_size / seconds(start);
+    std::cout << "batched\t\t " << (long long)create_rate << "\t\t " << (long long)delete_rate << "\t\t "
+              << std::count(results.begin(), results.end(), true) << "\n";
+}
+
+// Fragments a disk like the scaling benchmark, then creates new files of
+// 1..64 blocks and rewrites half of the surviving ones at a new size, once
+// with goal allocation off and once with it on, and prints how contiguous
+// the files written ended up (see SeekDistance). FS also needs
+// useGoalAllocation(on) and seekDistance(name).
+template <typename FS>
+void runLocalityBenchmark(const char *layout, DiskGeometry geometry)
+{
+    using namespace std::chrono;
+    int num_files = (int)std::min<long long>(20000, geometry.num_blocks / 64);
+
+    std::cout << "\n" << layout << " locality benchmark (" << num_files << " files on " << geometry.num_blocks
+              << " fragmented blocks)\n";
+    std::cout << "Goal\t Write ops/s\t Sequential steps\t Mean seek (blocks)\t Contiguous files\n";
+    std::cout << "=================================================================================\n";
+    for (bool goal : {false, true})
+    {
+        FS fs(geometry);
+        fs.useGoalAllocation(goal);
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> blocks_per_file(1, 64);
+        auto name = [](int i)
+        { return "file" + std::to_string(i); };
+        for (int i = 0; i < num_files; i++)
+            fs.createOrModifyFile(name(i), (long long)blocks_per_file(rng) * geometry.block_size);
+        for (int i = 0; i < num_files; i += 2)
+            fs.deleteFile(name(i));
+
+        std::vector<int> written;
+        int writes = 0;
+        auto start = high_resolution_clock::now();
+        auto write = [&](int i)
+        {
+            writes++;
+            if (fs.createOrModifyFile(name(i), (long long)blocks_per_file(rng) * geometry.block_size))
+                written.push_back(i);
+        };
+        for (int i = num_files; i < num_files + num_files / 2; i++)
+            write(i);
+        for (int i = 1; i < num_files; i += 4)
+            write(i);
+        double rate = writes / duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+
+        SeekDistance total;
+        int contiguous = 0;
+        for (int i : written)
+        {
+            SeekDistance file = fs.seekDistance(name(i));
+            contiguous += file.contiguous();
+            total.add(file);
+        }
+        std::cout << (goal ? "on" : "off") << "\t " << (long long)rate << "\t\t " << total.sequentialShare() * 100
+                  << "%\t\t\t " << total.meanDistance() << "\t\t\t " << 100.0 * contiguous / written.size() << "%\n";
+    }
+}
+
+// Fragments a disk like the scaling benchmark, then creates one file of
+// each size from 2^6 to 2^16 blocks, by fours, reads READ_BYTES from random
+// byte offsets of it with pread(name, offset, buffer, length) and prints
+// reads/s per file size. An untimed pass over the same offsets goes first,
+// so the metadata it touches is already cached. Every layout runs it with
+// no device attached, so pread only finds the blocks and counts the bytes
+// without copying them. That makes the programs comparable side by side: a
+// flat rate means the block for an offset is found without walking the
+// file. FS also needs pread, returning the bytes read.
+template <typename FS>
+void runRandomReadBenchmark(const char *layout, DiskGeometry geometry)
+{
+    using namespace std::chrono;
+    const int READS = 20000;
+    const int READ_BYTES = 512;
+    int num_files = (int)std::min<long long>(20000, geometry.num_blocks / 64);
+
+    std::cout << "\n" << layout << " random-offset reads (" << READ_BYTES << " bytes each on " << geometry.num_blocks
+              << " fragmented blocks)\n";
+    std::cout << "File blocks\t Reads/s\t Mean read (ns)\t Bytes read\n";
+    std::cout << "=================================================================\n";
+    FS fs(geometry);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> blocks_per_file(1, 64);
+    for (int i = 0; i < num_files; i++)
+        fs.createOrModifyFile("fill" + std::to_string(i), (long long)blocks_per_file(rng) * geometry.block_size);
+    for (int i = 0; i < num_files; i += 2)
+        fs.deleteFile("fill" + std::to_string(i));
+
+    std::vector<char> buffer(READ_BYTES);
+    for (long long file_blocks = 1 << 6; file_blocks <= 1 << 16; file_blocks *= 4)
+    {
+        std::string name = "random" + std::to_string(file_blocks);
+        long long size = file_blocks * geometry.block_size;
+        if (!fs.createOrModifyFile(name, size))
+            break;
+        std::uniform_int_distribution<long long> offset(0, size - 1);
+        std::vector<long long> offsets(READS);
+        for (long long &o : offsets)
+            o = offset(rng);
+        for (long long o : offsets)
+            fs.pread(name, o, buffer.data(), READ_BYTES); // untimed, warms the metadata
+        long long bytes = 0;
+        auto start = high_resolution_clock::now();
+        for (long long o : offsets)
+            bytes += fs.pread(name, o, buffer.data(), READ_BYTES);
+        double elapsed = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        std::cout << file_blocks << "\t\t " << (long long)(READS / elapsed) << "\t\t " << elapsed * 1e9 / READS
+                  << "\t\t " << bytes << "\n";
+        fs.deleteFile(name);
+    }
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SEEK_DISTANCE_H
+#define SEEK_DISTANCE_H
+
+#include <cstdlib>
+
+// How contiguous a file is, from its data blocks in file order. Every step
+// from one block to the next is sequential when it lands on the block right
+// after, otherwise the head has to seek: the distance is how many blocks it
+// lands away from where a sequential read would be. A file in one piece has
+// no seek distance at all.
+struct SeekDistance
+{
+    long long steps = 0;      // block to next block moves
+    long long sequential = 0; // moves to the very next block
+    long long distance = 0;   // blocks sought over, summed over the moves
+
+    void step(int from, int to)
+    {
+        long long gap = std::llabs((long long)to - from - 1);
+        steps++;
+        sequential += gap == 0;
+        distance += gap;
+    }
+
+    void add(const SeekDistance &other)
+    {
+        steps += other.steps;
+        sequential += other.sequential;
+        distance += other.distance;
+    }
+
+    bool contiguous() const { return sequential == steps; }
+    double sequentialShare() const { return steps ? (double)sequential / steps : 1; }
+    double meanDistance() const { return steps ? (double)distance / steps : 0; }
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef SHARDED_DIRECTORY_H
+#define SHARDED_DIRECTORY_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include "directory_index.h"
+
+// Directory that many threads can use at once.
+//
+// Names are spread over 2^SHARD_BITS DirectoryIndex shards by the top bits of
+// their hash, and every shard has its own reader/writer lock, so operations
+// on different files almost never wait for each other. Entries are only
+// reached through callbacks that run under the shard lock, no pointer into a
+// shard escapes.
+template <typename T, std::string T::*Key = &T::name, int SHARD_BITS = 6>
+class ShardedDirectory
+{
+public:
+    static const int SHARDS = 1 << SHARD_BITS;
+
+    // calls fn(const T &) with the file under a shared lock, false if there is no such file
+    template <typename Fn>
+    bool read(const std::string &name, Fn fn) const
+    {
+        const Shard &shard = shardOf(name);
+        std::shared_lock<std::shared_mutex> guard(shard.lock);
+        const T *entry = shard.index.find(name);
+        if (!entry)
+            return false;
+        fn(*entry);
+        return true;
+    }
+
+    // adds value, or swaps it in for the file of the same name and moves the
+    // old entry to *replaced. Returns true if a file was replaced.
+    bool insertOrReplace(const T &value, T *replaced)
+    {
+        Shard &shard = shardOf(value.*Key);
+        std::unique_lock<std::shared_mutex> guard(shard.lock);
+        T *entry = shard.index.find(value.*Key);
+        if (!entry)
+        {
+            shard.index.insert(value);
+            return false;
+        }
+        *replaced = std::move(*entry);
+        *entry = value;
+        return true;
+    }
+
+    // removes name and moves its entry to *removed, false if there is no such file
+    bool erase(const std::string &name, T *removed)
+    {
+        Shard &shard = shardOf(name);
+        std::unique_lock<std::shared_mutex> guard(shard.lock);
+        T *entry = shard.index.find(name);
+        if (!entry)
+            return false;
+        *removed = std::move(*entry);
+        shard.index.erase(name);
+        return true;
+    }
+
+    // visits every file, one shard at a time under its shared lock
+    template <typename Fn>
+    void forEach(Fn fn) const
+    {
+        for (const Shard &shard : shards)
+        {
+            std::shared_lock<std::shared_mutex> guard(shard.lock);
+            for (const T &entry : shard.index)
+                fn(entry);
+        }
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for (const Shard &shard : shards)
+        {
+            std::shared_lock<std::shared_mutex> guard(shard.lock);
+            total += shard.index.size();
+        }
+        return total;
+    }
+
+    void clear()
+    {
+        for (Shard &shard : shards)
+        {
+            std::unique_lock<std::shared_mutex> guard(shard.lock);
+            shard.index.clear();
+        }
+    }
+
+    size_t memoryBytes() const
+    {
+        size_t bytes = sizeof(shards);
+        for (const Shard &shard : shards)
+        {
+            std::shared_lock<std::shared_mutex> guard(shard.lock);
+            bytes += shard.index.memoryBytes();
+        }
+        return bytes;
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        mutable std::shared_mutex lock;
+        DirectoryIndex<T, Key> index;
+    };
+    Shard shards[SHARDS];
+
+    // top bits of the fibonacci mixed hash, DirectoryIndex probes with the bits from 32 up
+    static size_t shardIndex(const std::string &name)
+    {
+        return std::hash<std::string>()(name) * 0x9E3779B97F4A7C15ULL >> (64 - SHARD_BITS);
+    }
+    Shard &shardOf(const std::string &name) { return shards[shardIndex(name)]; }
+    const Shard &shardOf(const std::string &name) const { return shards[shardIndex(name)]; }
+};
+
+#endif